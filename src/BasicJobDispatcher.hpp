@@ -0,0 +1,1490 @@
+#pragma once
+
+#include <thread>
+#include <malloc.h>
+
+#include "JobDispatcher.hpp"
+#include "JobPolicies.hpp"
+
+// Implementation of BasicJobDispatcher. Everything that depends on the policies is instantiated
+// per configuration and called directly, the rest is shared in JobDispatcher.cpp. Only code that has
+// a handle or a job instead of the dispatcher's type goes through JobDispatcherBase::hooks: waits, wakeups
+// across dispatchers and appendJobs. Jobs of any configurations may wait on each other
+// The plain JobDispatcher API is the default configuration, include this to create any other one
+
+// Shared by every configuration, in JobDispatcher.cpp
+ThreadData* getThreadData();
+ThreadData* createThreadData(JobDispatcherBase* dispatcher, bool main);
+void attachThreadData(ThreadData* data);
+void detachThreadData(ThreadData* data);
+void attachSignalStack(ThreadData* data, const JobDispatcherBase* dispatcher);
+void destroyThreadData(ThreadData* data);
+bool registerJobDispatcher(JobDispatcherBase* dispatcher);
+void unregisterJobDispatcher(JobDispatcherBase* dispatcher);
+Fiber* finishJobs(JobCounter* counter, int32_t count, JobCounter* shard = nullptr);
+void deleteRecurringJobs(JobDispatcherBase* dispatcher);
+bool isRecurringJobDue(RecurringJob* recurring, int64_t now);
+RecurringJob* createRecurringJob(JobDispatcherBase* dispatcher, const RecurringJobDesc* desc, uint8_t stackClass);
+void collectJobDispatcherStats(const JobDispatcherBase* dispatcher, JobDispatcherStats* stats);
+
+// A registration owns its counter and job records, a trigger resets and queues them again
+struct RecurringJob
+{
+	typedef List<RecurringJob*>::Node LNode;
+
+	RecurringJobDesc desc;
+	CounterContainer container;     // Waiter is COUNTER_DONE between runs
+	Job* jobs;
+	int64_t period;         // Period trigger, in getHPCounter ticks
+	int64_t nextDue;
+	uint32_t tickCount;     // Tick trigger, ticks since the last trigger
+	volatile uint64_t runs;
+	volatile uint64_t overruns;
+
+	LNode lnode;
+
+	RecurringJob():lnode(this)
+	{
+		jobs = nullptr;
+	}
+};
+
+// Execution stack of the thread in the dispatcher's shared-stack pools, -1 if it has none
+// Workers have their slot's, the creating thread the one after them
+inline int getSharedStack(const JobDispatcherBase* dispatcher, const ThreadData* data)
+{
+	if(data == dispatcher->mainThreadData)
+		return dispatcher->numThreads;
+	if(data->dispatcher == dispatcher && !data->main && !data->external)
+		return data->workerIndex;
+	return -1;
+}
+
+// A job of the class may run on a fiber of the other one: it's as large, and not a shared stack
+// unless the job asked for one
+inline bool fitsStackClass(const JobDispatcherBase* dispatcher, uint8_t jobClass, uint8_t fiberClass)
+{
+	return fiberClass >= jobClass &&
+		(!dispatcher->fiberPools[fiberClass].isShared() || dispatcher->fiberPools[jobClass].isShared());
+}
+
+// A job that asked for a shared stack goes to the first shared-stack class as large as the one
+// picked for it, else the largest one. The others, and all jobs where there is none, keep the pick
+inline uint8_t getJobStackClass(const JobDispatcherBase* dispatcher, uint8_t stackClass, bool sharedStack)
+{
+	if(!sharedStack)
+		return stackClass;
+
+	int shared = -1;
+	for(uint8_t i = 0; i < dispatcher->numFiberPools; i++)
+	{
+		if(!dispatcher->fiberPools[i].isShared())
+			continue;
+		shared = i;
+		if(dispatcher->fiberPools[i].getStackSize() >= dispatcher->fiberPools[stackClass].getStackSize())
+			break;
+	}
+	return shared < 0 ? stackClass : (uint8_t)shared;
+}
+
+// Tries the job's stack class first, then the larger ones that fit. Shared-stack classes only on
+// a thread that has an execution stack in them
+inline Fiber* bindFiber(JobDispatcherBase* dispatcher, Job* job, int sharedStack)
+{
+	for(uint8_t i = job->stackClass; i < dispatcher->numFiberPools; i++)
+	{
+		if(!fitsStackClass(dispatcher, job->stackClass, i))
+			continue;
+		Fiber* fiber = dispatcher->fiberPools[i].newFiber(job, sharedStack);
+		if(fiber)
+			return fiber;
+	}
+	return nullptr;
+}
+
+// A fiber on a shared stack can only come back where its frames are, see StackClassDesc::shared
+inline bool isPinned(const Fiber* fiber)
+{
+	return fiber->job->pinned || fiber->ownerPool->isShared();
+}
+
+// Inherited priority without the jobLock. It's only ever raised, a stale read is less urgent
+inline JobPriority::Enum peekCounterPriority(const CounterContainer* container)
+{
+	return *(const volatile JobPriority::Enum*)&container->priority;
+}
+
+// A job's own priority, raised to the one its counter inherited. Caller holds the dispatcher's jobLock
+inline JobPriority::Enum getEffectivePriority(const Job* job)
+{
+	JobPriority::Enum inherited = ((const CounterContainer*)job->counter)->priority;
+	return inherited < job->priority ? inherited : job->priority;
+}
+
+// Wakes a job of any dispatcher through its own configuration
+inline void readyJob(Job* job)
+{
+	job->dispatcher->hooks->pushReadyJob(job);
+}
+
+inline bool isElastic(const JobDispatcherBase* dispatcher)
+{
+	return (dispatcher->flags & JobDispatcherFlags::ElasticWorkers) != 0;
+}
+
+// Microseconds from dispatch to now
+inline uint64_t getLatency(const Job* job, int64_t now)
+{
+	return (uint64_t)(now - job->dispatchTime)*1000000/(uint64_t)job->dispatcher->hpFrequency;
+}
+
+// Pinned fibers suspended on the worker and not resumed yet, they can't move to another thread
+inline uint32_t getPinnedFibers(const ThreadData* data)
+{
+	return data->pinnedFibers;
+}
+
+// A job with a worker affinity waits for that worker, unless it's not running
+inline bool isLeftToOtherWorker(const JobDispatcherBase* dispatcher, const Job* job, const ThreadData* data)
+{
+	if(job->worker < 0)
+		return false;
+	if(data->dispatcher == dispatcher && !data->main && !data->external && data->workerIndex == job->worker)
+		return false;
+	return job->worker < dispatcher->numThreads &&
+		dispatcher->workerData[job->worker]->state == WorkerState::Running;
+}
+
+// JobDispatcherFlags::Statistics timings, constant false where the trace policy has none
+template <typename Dispatcher>
+inline bool isStatsEnabled(const Dispatcher* dispatcher)
+{
+	return Dispatcher::TracePolicy::isTimed((dispatcher->flags & JobDispatcherFlags::Statistics) != 0);
+}
+
+template <typename Dispatcher>
+inline void addJob(Dispatcher* dispatcher, Job* job, bool front = false)
+{
+	int list = Dispatcher::QueuePolicy::getList(job->priority);
+	if(front)
+		dispatcher->waitList[list].add(&job->lnode);
+	else
+		dispatcher->waitList[list].addToEnd(&job->lnode);
+	if(dispatcher->queueDepth[list]++ == 0)
+		atomicStoreRelease(&dispatcher->pendingLists, dispatcher->pendingLists | (1 << list));
+}
+
+// Pulls a queued job off its list, it's the caller's from then on. Caller holds jobLock
+template <typename Dispatcher>
+inline void removeJob(Dispatcher* dispatcher, int list, Job::LNode* node)
+{
+	dispatcher->waitList[list].remove(node);
+	if(--dispatcher->queueDepth[list] == 0)
+		atomicStoreRelease(&dispatcher->pendingLists, dispatcher->pendingLists & ~(1 << list));
+}
+
+// New job, it starts at least at the priority its counter inherited. Caller holds jobLock
+template <typename Dispatcher>
+void queueNewJob(Dispatcher* dispatcher, Job* job)
+{
+	CounterContainer* container = (CounterContainer*)job->counter;
+	if(job->priority > container->lowestQueued)
+		container->lowestQueued = job->priority;
+	job->priority = getEffectivePriority(job);
+	addJob(dispatcher, job);
+}
+
+// Moves the jobs of unknown threads to the lists, oldest first. Caller holds jobLock
+template <typename Dispatcher>
+void drainInbox(Dispatcher* dispatcher)
+{
+	if(!atomicLoadAcquirePtr((void* const volatile*)&dispatcher->inbox))
+		return;
+
+	Job::LNode* node = (Job::LNode*)atomicExchangePtr((void* volatile*)&dispatcher->inbox, nullptr);
+	Job::LNode* oldest = nullptr;
+	while(node)
+	{
+		Job::LNode* next = node->next;
+		node->next = oldest;
+		oldest = node;
+		node = next;
+	}
+
+	while(oldest)
+	{
+		Job::LNode* next = oldest->next;
+		oldest->next = nullptr;
+		queueNewJob(dispatcher, oldest->data);
+		oldest = next;
+	}
+}
+
+// Queues on the job's own dispatcher, whichever group finished its children
+template <typename Dispatcher>
+void pushReadyJob(Job* job)
+{
+	Dispatcher* dispatcher = (Dispatcher*)job->dispatcher;
+	dispatcher->jobLock.lock();
+	job->priority = getEffectivePriority(job);
+	addJob(dispatcher, job);
+	dispatcher->jobLock.unlock();
+
+	dispatcher->semaphore.post();
+}
+
+// Gives the finished job's resources back and queues the jobs that were held only by it
+template <typename Dispatcher>
+void releaseResources(Dispatcher* dispatcher, Job* job)
+{
+	ResourceClaim* ready = dispatcher->resources.release(job->claim);
+	job->claim = nullptr;
+	if(!ready)
+		return;
+
+	uint32_t count = 0;
+	dispatcher->jobLock.lock();
+	while(ready)
+	{
+		ResourceClaim* next = ready->nextReady;
+		queueNewJob(dispatcher, ready->job);
+		ready = next;
+		count++;
+	}
+	dispatcher->jobLock.unlock();
+	dispatcher->semaphore.post(count);
+}
+
+// Wakes a waiter, directly when it's one of ours
+template <typename Dispatcher>
+inline void readyJob(Dispatcher* dispatcher, Job* job)
+{
+	if(job->dispatcher == dispatcher)
+		pushReadyJob<Dispatcher>(job);
+	else
+		readyJob(job);
+}
+
+// Runs on the scheduler stack, after the finished fiber's stack has been left for good
+// A recurring job is only counted off here, the registration may be freed as soon as it is
+template <typename Dispatcher>
+fcontext_transfer_t releaseFiber(fcontext_transfer_t transfer)
+{
+	Fiber* fiber = (Fiber*)transfer.data;
+	FiberPool* pool = fiber->ownerPool;
+	Job* job = fiber->job;
+	Dispatcher* dispatcher = (Dispatcher*)job->dispatcher;
+	JobCounter* counter = job->counter;
+
+	Dispatcher::StackPolicy::recordStack(dispatcher, job->callback, pool, fiber);
+
+	bool persistent = job->persistent;
+	if(!persistent)
+		dispatcher->jobPool.deleteInstance(job);
+	pool->deleteFiber(fiber);
+
+	if(persistent)
+	{
+		Fiber* waiter = finishJobs(counter, 1);
+		if(waiter)
+			readyJob(dispatcher, waiter->job);
+	}
+	return transfer;
+}
+
+// Runs on the parent's stack when the last child switched straight to it. The parent resumes
+// in waitJobs and takes the returned context as its scheduler, which hasn't changed
+template <typename Dispatcher>
+fcontext_transfer_t handoffFiber(fcontext_transfer_t transfer)
+{
+	releaseFiber<Dispatcher>(transfer);
+
+	ThreadData* data = getThreadData();
+	transfer.ctx = data->schedulerContext;
+	return transfer;
+}
+
+template <typename Dispatcher>
+void fiberCallback(fcontext_transfer_t transfer)
+{
+	Fiber* fiber = (Fiber*)transfer.data;
+	Job* job = fiber->job;
+	ThreadData* data = getThreadData();
+
+	data->schedulerContext = transfer.ctx;
+	data->running = fiber;
+
+	// Call user task callback
+	job->callback(job->jobIndex, job->userData);
+
+	// The job may have been suspended and resumed in between
+	data = getThreadData();
+	data->running = nullptr;
+	Dispatcher::TracePolicy::jobsExecuted(data->counters, 1);
+
+	// Job is finished, the last one wakes up the waiter
+	if(job->claim)
+		releaseResources((Dispatcher*)job->dispatcher, job);
+	Fiber* waiter = job->persistent ? nullptr : finishJobs(job->counter, 1, job->shard);
+	if(waiter)
+	{
+		if(waiter->job->dispatcher == job->dispatcher && !waiter->ownerPool->isShared() &&
+			(waiter->ownerThread == 0 || waiter->ownerThread == data->threadId))
+		{
+			// Switch straight to the parent instead of queueing it, this stack is released from there
+			waiter->ownerThread = 0;
+			ontop_fcontext(waiter->context, fiber, handoffFiber<Dispatcher>);
+		}
+		else
+		{
+			// Pinned elsewhere, it belongs to another group or its stack has to be copied back first
+			readyJob(waiter->job);
+		}
+	}
+
+	// Go back and delete the fiber once we are off its stack, else another thread could
+	// pick it up and reset the context while we still run on it
+	ontop_fcontext(data->schedulerContext, fiber, releaseFiber<Dispatcher>);
+}
+
+template <typename Dispatcher>
+int32_t threadFunc(void* userData);
+
+// Starts a worker on a free slot, joining the thread that left it first. Caller holds workerLock
+template <typename Dispatcher>
+bool spawnWorker(Dispatcher* dispatcher)
+{
+	if(dispatcher->numActiveThreads >= dispatcher->numThreads)
+		return false;
+
+	for(uint8_t i = 0; i < dispatcher->numThreads; i++)
+	{
+		ThreadData* data = dispatcher->workerData[i];
+		if(data->state != WorkerState::Free && data->state != WorkerState::Exited)
+			continue;
+
+		if(dispatcher->threads[i])
+		{
+			dispatcher->threads[i]->shutdown();
+			delete dispatcher->threads[i];
+			dispatcher->threads[i] = nullptr;
+		}
+
+		Thread* thread = new Thread();
+		if(!thread)
+			return false;
+
+		data->running = nullptr;
+		data->schedulerContext = nullptr;
+		data->state = WorkerState::Running;
+		dispatcher->numActiveThreads++;
+		dispatcher->threads[i] = thread;
+		thread->init(threadFunc<Dispatcher>, data, WORKER_STACK_SIZE);
+		return true;
+	}
+	return false;
+}
+
+// Adds a worker once the queue stayed deep, or jobs kept starting late, for ELASTIC_GROW_SAMPLES picks in a row
+template <typename Dispatcher>
+void checkLoad(Dispatcher* dispatcher, uint32_t pending, uint64_t latency)
+{
+	int32_t active = max(dispatcher->numActiveThreads, 1);
+	bool pressure = pending > dispatcher->growQueueDepth*(uint32_t)active ||
+		(dispatcher->growLatency && latency > dispatcher->growLatency);
+	if(!pressure)
+	{
+		if(dispatcher->pressure)
+			dispatcher->pressure = 0;
+		return;
+	}
+
+	if(atomicFetchAndAdd(&dispatcher->pressure, 1) + 1 < ELASTIC_GROW_SAMPLES ||
+		dispatcher->numActiveThreads >= dispatcher->numThreads)
+	{
+		return;
+	}
+
+	dispatcher->workerLock.lock();
+	dispatcher->pressure = 0;
+	spawnWorker(dispatcher);
+	dispatcher->workerLock.unlock();
+}
+
+// A run of tiny jobs, on the scheduler stack while its fiber calls them
+struct TinyRun
+{
+	ThreadData* data;
+	Fiber* fiber;       // Null if there was none, the run is called on the scheduler stack then
+	Job** jobs;
+	uint32_t numJobs;
+	uint32_t done;
+	int64_t runStart;
+};
+
+// Calls the jobs back to back until the time budget is used up. The fiber's job is the one being
+// called, so a stack overflow names it
+template <typename Dispatcher>
+void callTinyJobs(Dispatcher* dispatcher, TinyRun* run)
+{
+	bool stats = isStatsEnabled(dispatcher);
+	int64_t budget = dispatcher->tinyJobBudget;
+	while(run->done < run->numJobs)
+	{
+		Job* job = run->jobs[run->done++];
+		if(stats)
+			Dispatcher::TracePolicy::latency(run->data->counters, job->priority, getLatency(job, run->runStart));
+		if(run->fiber)
+			run->fiber->job = job;
+		job->callback(job->jobIndex, job->userData);
+
+		if(budget > 0 && run->done < run->numJobs && getHPCounter() - run->runStart > budget)
+			break;
+	}
+}
+
+template <typename Dispatcher>
+void tinyFiberCallback(fcontext_transfer_t transfer)
+{
+	TinyRun* run = (TinyRun*)transfer.data;
+	callTinyJobs((Dispatcher*)run->jobs[0]->dispatcher, run);
+
+	// Nothing on this stack is needed anymore, the scheduler releases the fiber
+	jump_fcontext(transfer.ctx, nullptr);
+}
+
+// Calls a run of tiny jobs back to back on one fiber, large enough for the most demanding of them
+// Once the time budget is used up the rest goes back to the front of the lists, and every counter
+// is released once for the run. Without a free fiber the run is called on the scheduler stack
+template <typename Dispatcher>
+void runTinyJobs(Dispatcher* dispatcher, ThreadData* data, Job** jobs, uint32_t numJobs, int64_t runStart)
+{
+	Job* biggest = jobs[0];
+	for(uint32_t i = 1; i < numJobs; i++)
+	{
+		if(jobs[i]->stackClass > biggest->stackClass)
+			biggest = jobs[i];
+	}
+
+	TinyRun run;
+	run.data = data;
+	run.fiber = bindFiber(dispatcher, biggest, getSharedStack(dispatcher, data));
+	run.jobs = jobs;
+	run.numJobs = numJobs;
+	run.done = 0;
+	run.runStart = runStart;
+	if(run.fiber)
+	{
+		// The job may be queued again, it must not look like one that started
+		Fiber* fiber = run.fiber;
+		biggest->fiber = nullptr;
+		FiberPool* pool = fiber->ownerPool;
+		pool->makeContext(fiber, tinyFiberCallback<Dispatcher>);
+		jump_fcontext(fiber->context, &run);
+
+		// The run's stack use is the profile of its first callback, it's mostly a single one
+		Dispatcher::StackPolicy::recordStack(dispatcher, jobs[0]->callback, pool, fiber);
+		pool->deleteFiber(fiber);
+	}
+	else
+	{
+		callTinyJobs(dispatcher, &run);
+	}
+
+	uint32_t done = run.done;
+	Dispatcher::TracePolicy::jobsExecuted(data->counters, done);
+
+	if(done < numJobs)
+	{
+		dispatcher->jobLock.lock();
+		for(uint32_t i = numJobs; i > done; i--)
+		{
+			Job* job = jobs[i - 1];
+			job->priority = getEffectivePriority(job);
+			addJob(dispatcher, job, true);
+		}
+		dispatcher->jobLock.unlock();
+		dispatcher->semaphore.post(numJobs - done);
+	}
+
+	// Jobs of one dispatch sit next to each other, so that's mostly a single counter, or the few
+	// shards of a sharded one taking turns. The records go first, a waiter may tear the dispatcher
+	// down as soon as its counter is released
+	JobCounter* counters[TINY_JOB_BATCH];
+	JobCounter* shards[TINY_JOB_BATCH];
+	int32_t counts[TINY_JOB_BATCH];
+	uint32_t numCounters = 0;
+	for(uint32_t i = 0; i < done; i++)
+	{
+		Job* job = jobs[i];
+		uint32_t k = numCounters;
+		if(numCounters > 0 && counters[numCounters - 1] == job->counter && shards[numCounters - 1] == job->shard)
+		{
+			k = numCounters - 1;
+		}
+		else if(job->shard)
+		{
+			for(k = 0; k < numCounters && shards[k] != job->shard; k++)
+			{
+			}
+		}
+
+		if(k == numCounters)
+		{
+			counters[numCounters] = job->counter;
+			shards[numCounters] = job->shard;
+			counts[numCounters++] = 0;
+		}
+		counts[k]++;
+		if(job->claim)
+			releaseResources(dispatcher, job);
+		if(!job->persistent)
+			dispatcher->jobPool.deleteInstance(job);
+	}
+
+	for(uint32_t i = 0; i < numCounters; i++)
+	{
+		Fiber* waiter = finishJobs(counters[i], counts[i], shards[i]);
+		if(waiter)
+			readyJob(dispatcher, waiter->job);
+	}
+}
+
+// A fiber is suspended on the counter
+inline bool hasWaitingFiber(const CounterContainer* container)
+{
+	Fiber* waiter = (Fiber*)atomicLoadAcquirePtr((void* const volatile*)&container->waiter);
+	return waiter && waiter != COUNTER_DONE && !((uintptr_t)waiter & COUNTER_EXTERNAL);
+}
+
+// Class of the pool a fiber of the dispatcher comes from
+inline uint8_t getFiberClass(const JobDispatcherBase* dispatcher, const Fiber* fiber)
+{
+	return (uint8_t)(fiber->ownerPool - dispatcher->fiberPools);
+}
+
+// No pool had a fiber left for a job of the counter. Its waiter is taken off the counter and resumed
+// to run the queued jobs on its own stack, else a tree of waiting jobs that holds every fiber would
+// wait forever. Returns the waiter if this thread may run it, see waitCounter for the other side
+template <typename Dispatcher>
+Fiber* helpWaiter(Dispatcher* dispatcher, ThreadData* data, CounterContainer* container, uint8_t stackClass)
+{
+	Fiber* waiter = (Fiber*)atomicLoadAcquirePtr((void* const volatile*)&container->waiter);
+	if(!waiter || waiter == COUNTER_DONE || ((uintptr_t)waiter & COUNTER_EXTERNAL))
+		return nullptr;
+	if(atomicCompareAndSwapPtr((void* volatile*)&container->waiter, waiter, nullptr) != waiter)
+		return nullptr;
+
+	// It's ours now. A waiter of another group or on a stack that doesn't fit can't take the jobs
+	if(waiter->job->dispatcher != dispatcher || container->dispatcher != dispatcher ||
+		!fitsStackClass(dispatcher, stackClass, getFiberClass(dispatcher, waiter)))
+	{
+		// Back on the counter, unless the jobs finished meanwhile
+		if(atomicCompareAndSwapPtr((void* volatile*)&container->waiter, nullptr, waiter) != nullptr)
+			readyJob(dispatcher, waiter->job);
+		return nullptr;
+	}
+
+	if(waiter->ownerThread != 0 && waiter->ownerThread != data->threadId)
+	{
+		pushReadyJob<Dispatcher>(waiter->job);
+		return nullptr;
+	}
+	return waiter;
+}
+
+// Takes a queued job of the counter that fits the waiting fiber's stack and runs it right there,
+// under the fiber's own job record for the duration. False if there was none
+// WorkFirstWaits takes the newest one, its data is the likeliest to still be in the cache
+template <typename Dispatcher>
+bool runChildJob(Dispatcher* dispatcher, Fiber* fiber, CounterContainer* container)
+{
+	uint8_t stackClass = getFiberClass(dispatcher, fiber);
+	bool newestFirst = (dispatcher->flags & JobDispatcherFlags::WorkFirstWaits) != 0;
+	Job* job = nullptr;
+	dispatcher->jobLock.lock();
+	for(int i = 0; i < Dispatcher::QueuePolicy::NumLists && !job; i++)
+	{
+		List<Job*>& list = dispatcher->waitList[i];
+		Job::LNode* node = newestFirst ? list.getLast() : list.getFirst();
+		for(; node; node = newestFirst ? node->prev : node->next)
+		{
+			Job* j = node->data;
+			if(j->counter == &container->counter && !j->fiber && fitsStackClass(dispatcher, j->stackClass, stackClass))
+			{
+				removeJob(dispatcher, i, node);
+				job = j;
+				break;
+			}
+		}
+	}
+	dispatcher->jobLock.unlock();
+	if(!job)
+		return false;
+
+	// It waits and resumes as the fiber's job, and stays on this thread if the waiter has to
+	Job* own = fiber->job;
+	job->fiber = fiber;
+	job->pinned = job->pinned || own->pinned;
+	fiber->job = job;
+	job->callback(job->jobIndex, job->userData);
+	fiber->job = own;
+
+	ThreadData* data = getThreadData();
+	Dispatcher::TracePolicy::jobsExecuted(data->counters, 1);
+
+	if(job->claim)
+		releaseResources(dispatcher, job);
+	JobCounter* counter = job->counter;
+	JobCounter* shard = job->shard;
+	if(!job->persistent)
+		dispatcher->jobPool.deleteInstance(job);
+	Fiber* waiter = finishJobs(counter, 1, shard);
+	if(waiter)
+		readyJob(dispatcher, waiter->job);
+	return true;
+}
+
+// Pulls the first runnable job and runs it on this thread until it finishes or suspends
+// Returns false if there was nothing to run, listNotEmpty tells if jobs were left behind
+// pinnedOnly skips everything but the fibers suspended on this thread, for draining workers
+template <typename Dispatcher>
+bool runNextJob(Dispatcher* dispatcher, ThreadData* data, bool* listNotEmpty, bool pinnedOnly = false)
+{
+	typedef typename Dispatcher::TracePolicy TracePolicy;
+	bool stats = isStatsEnabled(dispatcher);
+	bool elastic = isElastic(dispatcher);
+	bool timed = stats || elastic;
+	int64_t scanStart = stats ? getHPCounter() : 0;
+
+	Fiber* fiber = nullptr;
+	bool start = false;
+	int sharedStack = getSharedStack(dispatcher, data);
+	CounterContainer* stuck = nullptr;      // Of the first job no fiber was left for and a fiber waits on
+	uint8_t stuckClass = 0;
+	Job* tiny[TINY_JOB_BATCH];
+	uint32_t numTiny = 0;
+	uint32_t pending = 0;
+	*listNotEmpty = false;
+	dispatcher->jobLock.lock();
+	{
+		drainInbox(dispatcher);
+		for(int i = 0; i < Dispatcher::QueuePolicy::NumLists && !fiber && numTiny == 0; i++)
+		{
+			List<Job*>& list = dispatcher->waitList[i];
+			Job::LNode* node = list.getFirst();
+			while(node)
+			{
+				*listNotEmpty = true;
+				Job* j = node->data;
+				Fiber* f = j->fiber;
+				if(pinnedOnly && (!f || f->ownerThread != data->threadId))
+				{
+					f = nullptr;
+				}
+				else if(!f && isLeftToOtherWorker(dispatcher, j, data))
+				{
+					// Another worker starts it
+				}
+				else if(j->tiny)
+				{
+					// Takes the tiny jobs queued right behind it along
+					while(node && node->data->tiny && !isLeftToOtherWorker(dispatcher, node->data, data) &&
+						numTiny < TINY_JOB_BATCH)
+					{
+						Job::LNode* next = node->next;
+						removeJob(dispatcher, i, node);
+						tiny[numTiny++] = node->data;
+						node = next;
+					}
+					break;
+				}
+				else if(!f)
+				{
+					// Not started yet, it can run as soon as it gets a fiber
+					// Jobs on a shared stack are left to the threads that have one
+					f = bindFiber(dispatcher, j, sharedStack);
+					start = f != nullptr;
+					if(!f && !stuck && (sharedStack >= 0 || !dispatcher->fiberPools[j->stackClass].isShared()) &&
+						hasWaitingFiber((CounterContainer*)j->counter))
+					{
+						stuck = (CounterContainer*)j->counter;
+						stuckClass = j->stackClass;
+					}
+				}
+				else if(f->ownerThread != 0 && f->ownerThread != data->threadId)
+				{
+					// Pinned fibers go back to the thread they were suspended on
+					f = nullptr;
+				}
+
+				if(f)
+				{
+					// Job is ready to run, pull it from the wait list
+					fiber = f;
+					removeJob(dispatcher, i, node);
+					break;
+				}
+				node = node->next;
+			}
+		}
+
+		if((fiber || numTiny > 0) && elastic)
+		{
+			for(int i = 0; i < Dispatcher::QueuePolicy::NumLists; i++)
+				pending += dispatcher->queueDepth[i];
+		}
+	}
+	dispatcher->jobLock.unlock();
+
+	int64_t runStart = (timed || numTiny > 0) ? getHPCounter() : 0;
+	TracePolicy::poll(data->counters, fiber || numTiny > 0);
+	if(stats)
+		TracePolicy::idle(data->counters, runStart - scanStart);
+
+	if(numTiny > 0)
+	{
+		uint64_t latency = timed ? getLatency(tiny[0], runStart) : 0;
+		if(elastic)
+			checkLoad(dispatcher, pending, latency);
+
+		runTinyJobs(dispatcher, data, tiny, numTiny, runStart);
+		if(stats)
+			TracePolicy::busy(data->counters, getHPCounter() - runStart);
+		return true;
+	}
+
+	// The counter can't be released while one of its jobs is queued, past the lock it's only a hint.
+	// Its pool slot stays valid and a waiter taken off the wrong counter goes back to sleep
+	if(!fiber && stuck)
+		fiber = helpWaiter(dispatcher, data, stuck, stuckClass);
+	if(!fiber)
+		return false;
+
+	uint64_t latency = 0;
+	if(start)
+	{
+		fiber->ownerPool->makeContext(fiber, fiberCallback<Dispatcher>);
+		latency = timed ? getLatency(fiber->job, runStart) : 0;
+		if(stats)
+			TracePolicy::latency(data->counters, fiber->job->priority, latency);
+	}
+	else
+	{
+		fiber->ownerThread = 0;
+		fiber->ownerPool->restoreStack(fiber);
+	}
+
+	if(elastic)
+		checkLoad(dispatcher, pending, latency);
+
+	// Comes back here when the fiber finishes or suspends in waitJobs
+	jump_fcontext(fiber->context, fiber);
+
+	if(stats)
+		TracePolicy::busy(data->counters, getHPCounter() - runStart);
+	return true;
+}
+
+template <typename Dispatcher>
+int32_t threadFunc(void* userData)
+{
+	// Initialize thread data
+	ThreadData* data = (ThreadData*)userData;
+	Dispatcher* dispatcher = (Dispatcher*)data->dispatcher;
+	attachThreadData(data);
+	attachSignalStack(data, dispatcher);
+
+	// Best effort, the group still works where the OS says no
+	Thread::setPriority(dispatcher->threadPriority);
+	Thread::setAffinity(dispatcher->cpuMask);
+
+	// Each initial worker faults in its share of the stack arena, so startup doesn't pay for it
+	if((dispatcher->flags & JobDispatcherFlags::StackArenaPrefault) && dispatcher->stackArena.base &&
+		data->workerIndex < dispatcher->numInitialThreads)
+	{
+		prefault_fcontext_arena(&dispatcher->stackArena, data->workerIndex, dispatcher->numInitialThreads);
+	}
+
+	// Parked elastic workers wake up now and then to see if they should retire
+	int32_t timeout = isElastic(dispatcher) ? (int32_t)dispatcher->retireTimeout : -1;
+
+	// The thread's own stack is the scheduler context, every fiber run on this thread returns to it
+	while(!dispatcher->stop)
+	{
+		// A draining worker leaves once nothing is pinned to it anymore
+		if(data->state == WorkerState::Draining && getPinnedFibers(data) == 0)
+		{
+			dispatcher->workerLock.lock();
+			data->state = WorkerState::Exited;
+			dispatcher->workerLock.unlock();
+			break;
+		}
+
+		// Wait for a job to be placed in the job queue
+		bool woken;
+		if(isStatsEnabled(dispatcher))
+		{
+			int64_t parkStart = getHPCounter();
+			woken = dispatcher->semaphore.wait(timeout);
+			Dispatcher::TracePolicy::parked(data->counters, getHPCounter() - parkStart);
+		}
+		else
+		{
+			woken = dispatcher->semaphore.wait(timeout);     // Decreases list counter on continue
+		}
+
+		if(!woken)
+		{
+			// Parked the whole timeout, retire unless fibers are pinned here or we are at the minimum
+			bool retire = false;
+			dispatcher->workerLock.lock();
+			if(data->state == WorkerState::Running && getPinnedFibers(data) == 0 &&
+				dispatcher->numActiveThreads > dispatcher->minThreads)
+			{
+				data->state = WorkerState::Exited;
+				dispatcher->numActiveThreads--;
+				retire = true;
+			}
+			dispatcher->workerLock.unlock();
+			if(retire)
+				break;
+			continue;
+		}
+
+		// Draining workers leave new jobs to the active ones, unless there are none left to make progress
+		bool pinnedOnly = data->state == WorkerState::Draining && dispatcher->numActiveThreads > 0;
+		bool listNotEmpty;
+		if(!runNextJob(dispatcher, data, &listNotEmpty, pinnedOnly) && listNotEmpty)
+			dispatcher->semaphore.post(); // Increase the list counter because we didn't pull any jobs
+	}
+
+	// Job magazines go back to the depot, the thread's cache would be stranded in the pool
+	// until the dispatcher is destroyed. The slot's data stays, a later worker reuses it
+	dispatcher->jobPool.flushCache();
+	dispatcher->resources.flushCache();
+	detachThreadData(data);
+	destroySignalStack(data->signalStack);
+	data->signalStack = nullptr;
+	return 0;
+}
+
+template <typename Dispatcher>
+bool initJobDispatcher(Dispatcher* dispatcher, const JobDispatcherDesc* desc)
+{
+	dispatcher->flags = desc->flags;
+	dispatcher->growQueueDepth = desc->growQueueDepth;
+	dispatcher->growLatency = desc->growLatency;
+	dispatcher->retireTimeout = desc->retireTimeout;
+	dispatcher->threadPriority = desc->threadPriority;
+	dispatcher->cpuMask = desc->cpuMask;
+	dispatcher->hpFrequency = getHPFrequency();
+	dispatcher->tinyJobBudget = (int64_t)desc->tinyJobBudget*dispatcher->hpFrequency/1000000;
+	dispatcher->shardedBatchSize = desc->shardedBatchSize;
+	for(int i = 0; i < JobPriority::Count; i++)
+		dispatcher->priorityList[i] = (uint8_t)Dispatcher::QueuePolicy::getList((JobPriority::Enum)i);
+
+	// Nothing would take the measurements
+	if(!Dispatcher::StackPolicy::paintStacks(true))
+		dispatcher->flags &= ~JobDispatcherFlags::StackProfiling;
+	if(!Dispatcher::TracePolicy::isTimed(true))
+		dispatcher->flags &= ~JobDispatcherFlags::Statistics;
+
+	// Create fibers with stack memories, one pool per stack class
+	if(desc->numStackClasses == 0 || desc->numStackClasses > MAX_STACK_CLASSES)
+		return false;
+
+	// Jobs that don't ask for a shared stack need a dedicated class
+	int largestDedicated = -1;
+	int firstDedicated = -1;
+	for(uint8_t i = 0; i < desc->numStackClasses; i++)
+	{
+		if(desc->stackClasses[i].shared)
+			continue;
+		largestDedicated = i;
+		if(firstDedicated < 0)
+			firstDedicated = i;
+	}
+	if(largestDedicated < 0)
+		return false;
+
+	if(!registerJobDispatcher(dispatcher))
+		return false;
+
+	uint32_t numWorkerThreads;
+	if(desc->numThreads < 0)
+	{
+		uint32_t numCores = std::thread::hardware_concurrency();
+		numWorkerThreads = min(numCores ? (numCores - 1) : 0, UINT8_MAX);
+	}
+	else
+	{
+		numWorkerThreads = min((uint32_t)desc->numThreads, UINT8_MAX);
+	}
+	numWorkerThreads = max(numWorkerThreads, (uint32_t)desc->minThreads);
+	uint32_t numSlots = max(numWorkerThreads, (uint32_t)desc->maxThreads);
+	dispatcher->minThreads = min(desc->minThreads, (uint8_t)numSlots);
+	uint8_t numClasses = desc->numStackClasses;
+
+	if(desc->flags & JobDispatcherFlags::StackArena)
+	{
+		// One mapping for every fiber stack
+		size_t numStacks = 0;
+		size_t arenaSize = 0;
+		for(uint8_t i = 0; i < numClasses; i++)
+		{
+			const StackClassDesc& sc = desc->stackClasses[i];
+			uint32_t classStacks = sc.shared ? numSlots + 1 : sc.maxFibers;
+			numStacks += classStacks;
+			arenaSize += classStacks*get_fcontext_arena_stack_size(sc.stackSize);
+		}
+
+		int arenaFlags = (desc->flags & JobDispatcherFlags::StackArenaHugePages) ? FCONTEXT_ARENA_HUGE_PAGES : FCONTEXT_ARENA_GUARD_PAGES;
+		if(!create_fcontext_arena(&dispatcher->stackArena, arenaSize, numStacks, arenaFlags))
+			return false;
+	}
+
+	// The creating thread's data, shared with the other dispatchers created on it
+	ThreadData* mainData = getThreadData();
+	if(!mainData)
+	{
+		mainData = createThreadData(dispatcher, true);
+		if(!mainData)
+			return false;
+		attachThreadData(mainData);
+	}
+	attachSignalStack(mainData, dispatcher);
+	mainData->refCount++;
+	dispatcher->mainThreadData = mainData;
+
+	// Painting touches every stack anyway, prefaulting would also spoil the pattern
+	bool paintStacks = (dispatcher->flags & JobDispatcherFlags::StackProfiling) != 0;
+	if(paintStacks)
+		dispatcher->flags &= ~JobDispatcherFlags::StackArenaPrefault;
+
+	fcontext_arena_t* arena = (desc->flags & JobDispatcherFlags::StackArena) ? &dispatcher->stackArena : nullptr;
+	uint32_t maxFibers = 0;
+
+	dispatcher->numFiberPools = numClasses;
+	dispatcher->defaultStackClass = min(desc->defaultStackClass, (uint8_t)(numClasses - 1));
+	if(desc->stackClasses[dispatcher->defaultStackClass].shared)
+		dispatcher->defaultStackClass = (uint8_t)firstDedicated;
+	dispatcher->smallStackClass = numClasses;
+	dispatcher->bigStackClass = numClasses;
+	for(uint8_t i = 0; i < numClasses; i++)
+	{
+		// Shared stacks, one per worker slot and one for the creating thread, see getSharedStack
+		const StackClassDesc& sc = desc->stackClasses[i];
+		uint16_t numSharedStacks = sc.shared ? (uint16_t)(numSlots + 1) : 0;
+		if(!dispatcher->fiberPools[i].create(sc.maxFibers, sc.stackSize, paintStacks, arena, numSharedStacks))
+			return false;
+		maxFibers += sc.maxFibers;
+
+		if(sc.shared)
+			continue;
+		if(sc.stackSize >= DEFAULT_SMALL_STACKSIZE && dispatcher->smallStackClass == numClasses)
+			dispatcher->smallStackClass = i;
+		if(sc.stackSize >= DEFAULT_BIG_STACKSIZE && dispatcher->bigStackClass == numClasses)
+			dispatcher->bigStackClass = i;
+	}
+	if(dispatcher->smallStackClass == numClasses)
+		dispatcher->smallStackClass = (uint8_t)largestDedicated;
+	if(dispatcher->bigStackClass == numClasses)
+		dispatcher->bigStackClass = (uint8_t)largestDedicated;
+
+	if(!dispatcher->counterPool.create(maxFibers) ||
+		!dispatcher->jobPool.create(JOB_POOL_BUCKET_SIZE) ||
+		!dispatcher->resources.create(desc->maxResources))
+	{
+		return false;
+	}
+
+	// Create threads, every slot gets its data up front so stats can read it any time
+	if(numSlots > 0)
+	{
+		dispatcher->threads = (Thread**)malloc(sizeof(Thread*)*numSlots);
+		ThreadData** workerData = (ThreadData**)malloc(sizeof(ThreadData*)*numSlots);
+		dispatcher->workerData = workerData;
+		if(!dispatcher->threads || !workerData)
+			return false;
+		memset(dispatcher->threads, 0x00, sizeof(Thread*)*numSlots);
+		memset(workerData, 0x00, sizeof(ThreadData*)*numSlots);
+
+		dispatcher->numThreads = numSlots;
+		for(uint8_t i = 0; i < numSlots; i++)
+		{
+			workerData[i] = createThreadData(dispatcher, false);
+			if(!workerData[i])
+				return false;
+			workerData[i]->workerIndex = i;
+		}
+
+		dispatcher->numInitialThreads = numWorkerThreads;
+		dispatcher->workerLock.lock();
+		for(uint8_t i = 0; i < numWorkerThreads; i++)
+			spawnWorker(dispatcher);
+		dispatcher->workerLock.unlock();
+	}
+
+	if(numWorkerThreads == 0 && (dispatcher->flags & JobDispatcherFlags::StackArenaPrefault))
+	{
+		prefault_fcontext_arena(&dispatcher->stackArena, 0, 1);
+	}
+	return true;
+}
+
+// Must run on the thread that created the dispatcher
+template <typename Dispatcher>
+void destroyJobDispatcher(Dispatcher* dispatcher)
+{
+	if(!dispatcher)
+		return;
+
+	// Command all worker threads to stop
+	dispatcher->stop = 1;
+	dispatcher->semaphore.post(dispatcher->numThreads + 1);
+	for(uint8_t i = 0; i < dispatcher->numThreads; i++)
+	{
+		if(dispatcher->threads && dispatcher->threads[i])
+		{
+			dispatcher->threads[i]->shutdown();
+			delete dispatcher->threads[i];
+		}
+		if(dispatcher->workerData)
+			delete dispatcher->workerData[i];
+	}
+	free(dispatcher->threads);
+	free(dispatcher->workerData);
+
+	ThreadData* data = dispatcher->mainThreadData;
+	if(data && --data->refCount == 0)
+		destroyThreadData(data);
+
+	// Registrations nobody removed, their jobs finished with the workers
+	deleteRecurringJobs(dispatcher);
+
+	for(uint8_t i = 0; i < dispatcher->numFiberPools; i++)
+		dispatcher->fiberPools[i].destroy();
+	if(dispatcher->stackArena.base)
+		destroy_fcontext_arena(&dispatcher->stackArena);
+
+	dispatcher->counterPool.destroy();
+	dispatcher->jobPool.destroy();
+	dispatcher->resources.destroy();
+
+	unregisterJobDispatcher(dispatcher);
+	delete dispatcher;
+}
+
+template <typename Dispatcher>
+bool setWorkerCount(Dispatcher* dispatcher, uint8_t count)
+{
+	bool ok = count <= dispatcher->numThreads;
+	count = min(count, dispatcher->numThreads);
+
+	// Grow right away, shrink by draining the highest slots
+	uint8_t numDrained = 0;
+	uint8_t* drained = (uint8_t*)alloca(dispatcher->numThreads + 1);
+	dispatcher->workerLock.lock();
+	while(dispatcher->numActiveThreads < count && spawnWorker(dispatcher))
+	{
+	}
+	for(int i = dispatcher->numThreads - 1; i >= 0 && dispatcher->numActiveThreads > count; i--)
+	{
+		ThreadData* data = dispatcher->workerData[i];
+		if(data->state == WorkerState::Running)
+		{
+			data->state = WorkerState::Draining;
+			dispatcher->numActiveThreads--;
+			drained[numDrained++] = (uint8_t)i;
+		}
+	}
+	dispatcher->workerLock.unlock();
+	ok &= dispatcher->numActiveThreads == count;
+
+	if(numDrained == 0)
+		return ok;
+
+	// Parked workers have to wake up to notice, their fibers still get resumed through the job lists
+	// Any worker can take the wakeup, so it's repeated every millisecond until the slot is left
+	int64_t period = dispatcher->hpFrequency/1000;
+	for(uint8_t k = 0; k < numDrained; k++)
+	{
+		ThreadData* data = dispatcher->workerData[drained[k]];
+		int64_t nextPost = 0;
+		while(data->state == WorkerState::Draining)
+		{
+			int64_t now = getHPCounter();
+			if(now >= nextPost)
+			{
+				dispatcher->semaphore.post();
+				nextPost = now + period;
+			}
+			Thread::yield();
+		}
+
+		// Unless a new worker took the slot already
+		dispatcher->workerLock.lock();
+		Thread* thread = dispatcher->threads[drained[k]];
+		if(data->state == WorkerState::Exited && thread)
+		{
+			thread->shutdown();
+			delete thread;
+			dispatcher->threads[drained[k]] = nullptr;
+			data->state = WorkerState::Free;
+		}
+		dispatcher->workerLock.unlock();
+	}
+	return ok;
+}
+
+// Creates the jobs on counter and queues them, returns how many could be created
+// A batch with a job whose resources can't be claimed is refused whole, see JobDesc::resources
+// stackClass < 0 picks the class per job. With shards the jobs count on them, see CounterContainer::counter
+template <typename Dispatcher>
+uint32_t queueJobs(Dispatcher* dispatcher, JobCounter* counter, const JobDesc* jobs, uint16_t numJobs, int stackClass,
+	uint8_t* shards = nullptr, uint32_t numShards = 0)
+{
+	// Create N Jobs, fibers are bound when they start
+	int64_t dispatchTime = (isStatsEnabled(dispatcher) || isElastic(dispatcher)) ? getHPCounter() : 0;
+	uint32_t count = 0;
+	Job** newJobs = (Job**)alloca(sizeof(Job*)*numJobs);
+
+	// An unknown thread has nothing that would flush a magazine cache when it exits
+	bool known = getThreadData() != nullptr;
+	bool refused = false;
+	for(uint16_t i = 0; i < numJobs && !refused; i++)
+	{
+		Job* job = known ? dispatcher->jobPool.newInstance() : dispatcher->jobPool.newInstanceUncached();
+		if(!job)
+			continue;
+
+		job->claim = nullptr;
+		if(jobs[i].numResources > 0)
+		{
+			job->claim = dispatcher->resources.createClaim(job, jobs[i].resources, jobs[i].numResources, known);
+			refused = job->claim == nullptr;
+		}
+		newJobs[count++] = job;
+		if(refused)
+			break;
+
+		job->callback = jobs[i].callback;
+		job->userData = jobs[i].userParam;
+		job->dispatcher = dispatcher;
+		job->counter = counter;
+		job->shard = nullptr;
+		job->fiber = nullptr;
+		job->jobIndex = i;
+		job->stackClass = getJobStackClass(dispatcher,
+			(uint8_t)(stackClass < 0 ? Dispatcher::StackPolicy::getStackClass(dispatcher, jobs[i].callback) : stackClass),
+			jobs[i].sharedStack);
+		job->worker = -1;
+		job->priority = jobs[i].priority;
+		job->pinned = jobs[i].pinned || (dispatcher->flags & JobDispatcherFlags::PinnedFibers) != 0;
+		job->tiny = jobs[i].tiny;
+		job->persistent = false;
+		job->dispatchTime = dispatchTime;
+	}
+
+	// Nothing was counted or queued yet, dropping only some of them would lose their updates
+	if(refused)
+	{
+		for(uint32_t i = 0; i < count; i++)
+		{
+			if(newJobs[i]->claim)
+				dispatcher->resources.deleteClaim(newJobs[i]->claim, known);
+			if(known)
+				dispatcher->jobPool.deleteInstance(newJobs[i]);
+			else
+				dispatcher->jobPool.deallocateUncached(newJobs[i]);
+		}
+		return 0;
+	}
+	if(count == 0)
+		return 0;
+
+	// Counted before any of them can run and finish. Round robin over the shards, the workers that
+	// take neighbouring jobs finish them on different lines
+	if(numShards > 0)
+	{
+		for(uint32_t i = 0; i < numShards; i++)
+			*(JobCounter*)(shards + i*COUNTER_SHARD_STRIDE) = 0;
+		for(uint32_t i = 0; i < count; i++)
+		{
+			JobCounter* shard = (JobCounter*)(shards + (i % numShards)*COUNTER_SHARD_STRIDE);
+			newJobs[i]->shard = shard;
+			(*shard)++;
+		}
+		atomicFetchAndAdd(counter, (int32_t)min(count, numShards));
+	}
+	else
+	{
+		atomicFetchAndAdd(counter, (int32_t)count);
+	}
+
+	// Jobs that have to wait for a resource are left out, the release that lets them go queues them
+	uint32_t numReady = 0;
+	for(uint32_t i = 0; i < count; i++)
+	{
+		if(!newJobs[i]->claim || dispatcher->resources.enqueue(newJobs[i]->claim))
+			newJobs[numReady++] = newJobs[i];
+	}
+	if(numReady == 0)
+		return count;
+
+	if(known)
+	{
+		dispatcher->jobLock.lock();
+		for(uint32_t i = 0; i < numReady; i++)
+			queueNewJob(dispatcher, newJobs[i]);
+		dispatcher->jobLock.unlock();
+	}
+	else
+	{
+		// Unknown thread, it shouldn't stall on the job lock. The batch goes on the inbox in one
+		// swap, newest first like the rest of it
+		for(uint32_t i = 1; i < numReady; i++)
+			newJobs[i]->lnode.next = &newJobs[i - 1]->lnode;
+
+		Job::LNode* first = &newJobs[numReady - 1]->lnode;
+		Job::LNode* last = &newJobs[0]->lnode;
+		Job::LNode* head = (Job::LNode*)atomicLoadAcquirePtr((void* const volatile*)&dispatcher->inbox);
+		for(;;)
+		{
+			last->next = head;
+			Job::LNode* prev = (Job::LNode*)atomicCompareAndSwapPtr((void* volatile*)&dispatcher->inbox, head, first);
+			if(prev == head)
+				break;
+			head = prev;
+		}
+	}
+
+	// post to semaphore so worker threads can continue and fetch them
+	dispatcher->semaphore.post(numReady);
+	return count;
+}
+
+template <typename Dispatcher>
+JobHandle dispatch(Dispatcher* dispatcher, const JobDesc* jobs, uint16_t numJobs, int stackClass)
+{
+	// Get a counter
+	dispatcher->counterLock.lock();
+	CounterContainer* container = dispatcher->counterPool.newInstance();
+	dispatcher->counterLock.unlock();
+	if(!container)
+	{
+		return nullptr;
+	}
+	JobCounter* counter = &container->counter;
+	*counter = 0;
+	container->waiter = nullptr;
+	container->dispatcher = dispatcher;
+	container->priority = JobPriority::Count;
+	container->lowestQueued = JobPriority::High;
+	container->parent = nullptr;
+
+	// A wide batch gets a shard per thread that may run its jobs, the workers and the creating thread
+	container->shards = nullptr;
+	uint32_t numShards = 0;
+	if(dispatcher->shardedBatchSize && numJobs >= dispatcher->shardedBatchSize)
+	{
+		numShards = min((uint32_t)dispatcher->numThreads + 1, (uint32_t)numJobs / COUNTER_SHARD_MIN_JOBS);
+		if(numShards > 1)
+			container->shards = (uint8_t*)alignedAlloc(numShards*COUNTER_SHARD_STRIDE, COUNTER_SHARD_STRIDE);
+		if(!container->shards)
+			numShards = 0;
+	}
+
+	if(queueJobs(dispatcher, counter, jobs, numJobs, stackClass, container->shards, numShards) == 0)
+	{
+		if(container->shards)
+			alignedFree(container->shards);
+		dispatcher->counterLock.lock();
+		dispatcher->counterPool.deleteInstance(container);
+		dispatcher->counterLock.unlock();
+		return nullptr;
+	}
+	return counter;
+}
+
+// Raises the counter to the given priority and moves its queued jobs up, false if it was there already
+template <typename Dispatcher>
+bool raiseCounter(CounterContainer* container, JobPriority::Enum priority)
+{
+	typedef typename Dispatcher::QueuePolicy QueuePolicy;
+	if(priority >= peekCounterPriority(container))
+		return false;
+
+	Dispatcher* dispatcher = (Dispatcher*)container->dispatcher;
+	dispatcher->jobLock.lock();
+	bool raised = priority < container->priority;
+	if(raised)
+	{
+		container->priority = priority;
+
+		// Running jobs pick it up when they are queued again or wait themselves
+		int target = QueuePolicy::getList(priority);
+		for(int i = target + 1; i <= QueuePolicy::getList(container->lowestQueued); i++)
+		{
+			List<Job*>& list = dispatcher->waitList[i];
+			Job::LNode* node = list.getFirst();
+			while(node)
+			{
+				Job::LNode* next = node->next;
+				Job* job = node->data;
+				if(job->counter == &container->counter)
+				{
+					removeJob(dispatcher, i, node);
+					job->priority = priority;
+					addJob(dispatcher, job);
+				}
+				node = next;
+			}
+		}
+	}
+	dispatcher->jobLock.unlock();
+	return raised;
+}
+
+template <typename Dispatcher>
+RecurringJobHandle addRecurringJob(Dispatcher* dispatcher, const RecurringJobDesc* desc)
+{
+	if(!dispatcher || !desc->job.callback || desc->numJobs == 0)
+		return nullptr;
+
+	uint8_t stackClass = Dispatcher::StackPolicy::getStackClass(dispatcher, desc->job.callback);
+	RecurringJob* recurring = createRecurringJob(dispatcher, desc, stackClass);
+	if(!recurring)
+		return nullptr;
+
+	dispatcher->recurringLock.lock();
+	dispatcher->recurringJobs.addToEnd(&recurring->lnode);
+	dispatcher->recurringLock.unlock();
+	return recurring;
+}
+
+template <typename Dispatcher>
+uint32_t tickRecurringJobs(Dispatcher* dispatcher)
+{
+	int64_t now = getHPCounter();
+	int64_t dispatchTime = (isStatsEnabled(dispatcher) || isElastic(dispatcher)) ? now : 0;
+	uint32_t numQueued = 0;
+	uint32_t numOverruns = 0;
+
+	dispatcher->recurringLock.lock();
+	dispatcher->jobLock.lock();
+	for(RecurringJob::LNode* node = dispatcher->recurringJobs.getFirst(); node; node = node->next)
+	{
+		RecurringJob* recurring = node->data;
+		if(!isRecurringJobDue(recurring, now))
+			continue;
+
+		// The last job of the previous run swaps in COUNTER_DONE after everything else it touches
+		CounterContainer* container = &recurring->container;
+		if(atomicLoadAcquirePtr((void* const volatile*)&container->waiter) != COUNTER_DONE)
+		{
+			recurring->overruns++;
+			numOverruns++;
+			continue;
+		}
+
+		container->waiter = nullptr;
+		container->priority = JobPriority::Count;
+		container->lowestQueued = JobPriority::High;
+		atomicStoreRelease(&container->counter, (int32_t)recurring->desc.numJobs);
+		for(uint16_t i = 0; i < recurring->desc.numJobs; i++)
+		{
+			Job* job = &recurring->jobs[i];
+			job->fiber = nullptr;
+			job->priority = recurring->desc.job.priority;
+			job->dispatchTime = dispatchTime;
+			queueNewJob(dispatcher, job);
+		}
+		recurring->runs++;
+		numQueued += recurring->desc.numJobs;
+	}
+	dispatcher->jobLock.unlock();
+	dispatcher->recurringLock.unlock();
+
+	if(numQueued)
+		dispatcher->semaphore.post(numQueued);
+	return numOverruns;
+}
+
+template <typename Dispatcher>
+void getJobDispatcherStats(Dispatcher* dispatcher, JobDispatcherStats* stats)
+{
+	collectJobDispatcherStats(dispatcher, stats);
+	for(int i = 0; i < Dispatcher::QueuePolicy::NumLists; i++)
+		stats->priorities[Dispatcher::QueuePolicy::getListPriority(i)].queueDepth += dispatcher->queueDepth[i];
+}
+
+// Casts back from the dispatcher a handle or job knows
+template <typename Dispatcher>
+struct BasicJobDispatcherHooks
+{
+	static uint32_t queueJobs(JobDispatcherBase* dispatcher, JobCounter* counter, const JobDesc* jobs, uint16_t numJobs, int stackClass)
+	{
+		return ::queueJobs((Dispatcher*)dispatcher, counter, jobs, numJobs, stackClass);
+	}
+
+	static bool runNextJob(JobDispatcherBase* dispatcher, ThreadData* data, bool* listNotEmpty)
+	{
+		return ::runNextJob((Dispatcher*)dispatcher, data, listNotEmpty);
+	}
+
+	static bool runChildJob(JobDispatcherBase* dispatcher, Fiber* fiber, CounterContainer* container)
+	{
+		return ::runChildJob((Dispatcher*)dispatcher, fiber, container);
+	}
+
+	static const JobDispatcherHooks hooks;
+};
+
+template <typename Dispatcher>
+const JobDispatcherHooks BasicJobDispatcherHooks<Dispatcher>::hooks =
+{
+	pushReadyJob<Dispatcher>,
+	BasicJobDispatcherHooks<Dispatcher>::queueJobs,
+	BasicJobDispatcherHooks<Dispatcher>::runNextJob,
+	BasicJobDispatcherHooks<Dispatcher>::runChildJob,
+	raiseCounter<Dispatcher>,
+};
+
+// API of the configurations, the same calls as for JobDispatcher. destroyJobDispatcher,
+// setWorkerCount, addRecurringJob, tickRecurringJobs and getJobDispatcherStats are the templates above
+template <typename Dispatcher>
+Dispatcher* createBasicJobDispatcher(const JobDispatcherDesc* desc = nullptr)
+{
+	Dispatcher* dispatcher = new Dispatcher();
+	if(!dispatcher)
+		return nullptr;
+	dispatcher->hooks = &BasicJobDispatcherHooks<Dispatcher>::hooks;
+
+	JobDispatcherDesc defaultDesc;
+	if(!initJobDispatcher(dispatcher, desc ? desc : &defaultDesc))
+	{
+		destroyJobDispatcher<Dispatcher>(dispatcher);
+		return nullptr;
+	}
+	return dispatcher;
+}
+
+template <typename Q, typename L, typename W, typename S, typename T>
+JobHandle dispatchJobs(BasicJobDispatcher<Q, L, W, S, T>* dispatcher, const JobDesc* jobs, uint16_t numJobs)
+{
+	return ::dispatch(dispatcher, jobs, numJobs, -1);
+}
+
+template <typename Q, typename L, typename W, typename S, typename T>
+JobHandle dispatchSmallJobs(BasicJobDispatcher<Q, L, W, S, T>* dispatcher, const JobDesc* jobs, uint16_t numJobs)
+{
+	return ::dispatch(dispatcher, jobs, numJobs, dispatcher->smallStackClass);
+}
+
+template <typename Q, typename L, typename W, typename S, typename T>
+JobHandle dispatchBigJobs(BasicJobDispatcher<Q, L, W, S, T>* dispatcher, const JobDesc* jobs, uint16_t numJobs)
+{
+	return ::dispatch(dispatcher, jobs, numJobs, dispatcher->bigStackClass);
+}
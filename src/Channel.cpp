@@ -0,0 +1,266 @@
+#include "Channel.hpp"
+
+#define WAITER_WAITING -1
+#define WAITER_NAP_MSECS 1     // Plain thread that runs jobs, between looks at its dispatcher's lists
+
+// A channelSelect blocked on its cases. Whoever moves state off WAITER_WAITING owns the wake,
+// it's either a peer or the waiter itself when it finds a case ready before it parks
+struct ChannelWaiter
+{
+	Fiber* fiber;               // Null on a plain thread, it sleeps on the semaphore instead of parking
+	Semaphore* semaphore;       // Posted by the peer that wakes a plain thread, on its stack
+	volatile int32_t state;     // Index of the case that woke it
+	volatile int32_t handoff;   // The peer and the parked fiber both count in, the second one requeues it
+};
+
+static volatile int32_t s_selectStart = 0;
+
+ChannelBase::ChannelBase()
+{
+	m_closed = 0;
+	m_numSenders = 0;
+	m_numReceivers = 0;
+}
+
+ChannelBase::~ChannelBase()
+{
+}
+
+void ChannelBase::close()
+{
+	atomicStoreRelease(&m_closed, 1);
+	atomicFence();
+	while(wakeOne(true));
+	while(wakeOne(false));
+}
+
+bool ChannelBase::isClosed() const
+{
+	return atomicLoadAcquire(&m_closed) != 0;
+}
+
+ChannelResult::Enum ChannelBase::transfer(bool send, void* value, bool wait)
+{
+	ChannelSelectCase c = makeCase(send, value);
+	if(channelSelect(&c, 1, wait) < 0)
+		return ChannelResult::WouldBlock;
+	return c.closed ? ChannelResult::Closed : ChannelResult::Done;
+}
+
+ChannelSelectCase ChannelBase::makeCase(bool send, void* value)
+{
+	ChannelSelectCase c;
+	c.channel = this;
+	c.value = value;
+	c.send = send;
+	return c;
+}
+
+// The fast path. A waiter queues, fences and looks again before it parks, the completed operation
+// is published before the fence here, so either the waiter sees it or it's counted in below
+ChannelResult::Enum ChannelBase::complete(bool send, void* value)
+{
+	ChannelResult::Enum result = tryOp(send, value);
+	if(result == ChannelResult::Done)
+	{
+		atomicFence();
+		if(atomicLoadAcquire(send ? &m_numReceivers : &m_numSenders) > 0)
+			wakeOne(!send);
+	}
+	return result;
+}
+
+void ChannelBase::addWaiter(ChannelWaitNode* node, bool send)
+{
+	m_lock.lock();
+	(send ? m_senders : m_receivers).addToEnd(&node->lnode);
+	atomicFetchAndAdd(send ? &m_numSenders : &m_numReceivers, 1);
+	node->queued = true;
+	m_lock.unlock();
+}
+
+void ChannelBase::removeWaiter(ChannelWaitNode* node, bool send)
+{
+	m_lock.lock();
+	if(node->queued)
+	{
+		(send ? m_senders : m_receivers).remove(&node->lnode);
+		atomicFetchAndSub(send ? &m_numSenders : &m_numReceivers, 1);
+		node->queued = false;
+	}
+	m_lock.unlock();
+}
+
+// Wakes the first waiter on that side that isn't woken yet, returns false if there was none
+// The waiter may unqueue as soon as the lock is released, only a parked fiber or a sleeping
+// thread is touched afterwards, neither returns before the handoff or the post
+bool ChannelBase::wakeOne(bool send)
+{
+	List<ChannelWaitNode*>& list = send ? m_senders : m_receivers;
+	ChannelWaiter* woken = nullptr;
+	Fiber* fiber = nullptr;
+	Semaphore* semaphore = nullptr;
+
+	m_lock.lock();
+	while(ChannelWaitNode::LNode* lnode = list.getFirst())
+	{
+		ChannelWaitNode* node = lnode->data;
+		list.remove(lnode);
+		atomicFetchAndSub(send ? &m_numSenders : &m_numReceivers, 1);
+		node->queued = false;
+
+		// Another case of the same select may have woken it already
+		ChannelWaiter* waiter = node->waiter;
+		Fiber* f = waiter->fiber;
+		Semaphore* sem = waiter->semaphore;
+		if(atomicCompareAndSwap(&waiter->state, WAITER_WAITING, node->index) == WAITER_WAITING)
+		{
+			woken = waiter;
+			fiber = f;
+			semaphore = sem;
+			break;
+		}
+	}
+	m_lock.unlock();
+
+	if(fiber && atomicFetchAndAdd(&woken->handoff, 1) == 1)
+		unparkFiber(fiber);
+	else if(semaphore)
+		semaphore->post();
+	return woken != nullptr;
+}
+
+static void onWaiterParked(Fiber* fiber, void* userParam)
+{
+	// Woken before it got off its stack, it goes right back in the job list
+	ChannelWaiter* waiter = (ChannelWaiter*)userParam;
+	if(atomicFetchAndAdd(&waiter->handoff, 1) == 1)
+		unparkFiber(fiber);
+}
+
+int ChannelBase::tryCases(ChannelSelectCase* cases, int numCases, int start)
+{
+	for(int i = 0; i < numCases; i++)
+	{
+		int index = (start + i) % numCases;
+		ChannelSelectCase& c = cases[index];
+		if(!c.channel)
+			continue;
+
+		ChannelResult::Enum result = c.channel->complete(c.send, c.value);
+		if(result != ChannelResult::WouldBlock)
+		{
+			c.closed = result == ChannelResult::Closed;
+			return index;
+		}
+	}
+	return -1;
+}
+
+int channelSelect(ChannelSelectCase* cases, int numCases, bool wait)
+{
+	if(numCases <= 0 || numCases > MAX_CHANNEL_SELECT_CASES)
+		return -1;
+
+	// No case gets starved by the ones before it
+	int start = numCases > 1 ? (int)((uint32_t)atomicFetchAndAdd(&s_selectStart, 1) % (uint32_t)numCases) : 0;
+	int done = ChannelBase::tryCases(cases, numCases, start);
+	if(done >= 0 || !wait)
+		return done;
+
+	Fiber* fiber = getRunningFiber();
+	if(fiber)
+		return ChannelBase::waitCases(cases, numCases, fiber, nullptr);
+
+	// Only a thread that has to sleep pays for a semaphore
+	Semaphore semaphore;
+	return ChannelBase::waitCases(cases, numCases, nullptr, &semaphore);
+}
+
+// The records peers touch while the select waits
+struct ChannelWaitRecords
+{
+	ChannelWaitNode nodes[MAX_CHANNEL_SELECT_CASES];
+	ChannelWaiter waiter;
+};
+
+int ChannelBase::waitCases(ChannelSelectCase* cases, int numCases, Fiber* fiber, Semaphore* semaphore)
+{
+	// A fiber on a shared stack has its stack copied away while it waits, they go on the heap then
+	ChannelWaitRecords local;
+	ChannelWaitRecords* records = fiber && fiber->ownerPool->isShared() ? new ChannelWaitRecords() : &local;
+	ChannelWaitNode* nodes = records->nodes;
+	ChannelWaiter& waiter = records->waiter;
+	waiter.fiber = fiber;
+	waiter.semaphore = semaphore;
+	bool runJobs = !fiber && canRunPendingJobs();
+
+	for(;;)
+	{
+		waiter.state = WAITER_WAITING;
+		waiter.handoff = 0;
+		for(int i = 0; i < numCases; i++)
+		{
+			nodes[i].waiter = &waiter;
+			nodes[i].index = i;
+			nodes[i].queued = false;
+			if(cases[i].channel)
+				cases[i].channel->addWaiter(&nodes[i], cases[i].send);
+		}
+
+		// A peer that completed before we got queued didn't see us, look again
+		atomicFence();
+		for(int i = 0; i < numCases; i++)
+		{
+			if(cases[i].channel && cases[i].channel->isReady(cases[i].send) &&
+				atomicCompareAndSwap(&waiter.state, WAITER_WAITING, i) == WAITER_WAITING)
+			{
+				// Woke ourselves, no peer will touch the waiter
+				waiter.handoff = -1;
+				break;
+			}
+		}
+
+		if(waiter.handoff != -1)
+		{
+			if(fiber)
+			{
+				parkFiber(onWaiterParked, &waiter);
+			}
+			else
+			{
+				// Returns on the peer's post only, it may still be on its way to it when the state
+				// changes. The peers may be jobs this thread has to run, it naps between them
+				for(;;)
+				{
+					if(runJobs && atomicLoadAcquire(&waiter.state) == WAITER_WAITING && runPendingJob())
+						continue;
+					if(semaphore->wait(runJobs ? WAITER_NAP_MSECS : -1))
+						break;
+				}
+			}
+		}
+
+		for(int i = 0; i < numCases; i++)
+		{
+			if(cases[i].channel)
+				cases[i].channel->removeWaiter(&nodes[i], cases[i].send);
+		}
+
+		int woken = waiter.state;
+		int done = tryCases(cases, numCases, woken);
+		if(done < 0)
+		{
+			// Somebody else got there first, wait again
+			continue;
+		}
+
+		// The wake was meant for the woken case, pass it on if another one completed instead
+		ChannelSelectCase& c = cases[woken];
+		if(done != woken && waiter.handoff != -1)
+			c.channel->wakeOne(c.send);
+		if(records != &local)
+			delete records;
+		return done;
+	}
+}
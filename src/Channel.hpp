@@ -0,0 +1,263 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "JobDispatcher.hpp"
+#include "List.hpp"
+#include "Lock.hpp"
+#include "Ring.hpp"
+
+#define MAX_CHANNEL_SELECT_CASES 16
+
+struct ChannelResult
+{
+	enum Enum
+	{
+		Done = 0,
+		WouldBlock,     // Full on send, empty on receive
+		Closed,         // Closed on send, closed and drained on receive
+	};
+};
+
+class ChannelBase;
+
+// One operation of a channelSelect. value is sent from or received into, it has to stay valid
+// until channelSelect returns
+struct ChannelSelectCase
+{
+	ChannelBase* channel;   // Null cases never complete
+	void* value;
+	bool send;
+	bool closed;            // Out, the case completed because the channel is closed
+
+	ChannelSelectCase()
+	{
+		channel = nullptr;
+		value = nullptr;
+		send = false;
+		closed = false;
+	}
+};
+
+// Completes one of the cases, the ready ones are tried in rotating order. Blocks until one can
+// complete if wait is set: a job suspends until a peer wakes it, a plain thread sleeps, running
+// jobs of its dispatcher meanwhile if it has one. Returns the index of the completed case, -1 if
+// none could complete without waiting or there are more than MAX_CHANNEL_SELECT_CASES
+int channelSelect(ChannelSelectCase* cases, int numCases, bool wait = true);
+
+struct ChannelWaiter;
+
+// A waiter queued on one channel, lives on the waiting stack
+struct ChannelWaitNode
+{
+	typedef List<ChannelWaitNode*>::Node LNode;
+
+	ChannelWaiter* waiter;
+	int32_t index;      // Of the case in the select
+	bool queued;        // Under the channel lock, cleared by whoever takes it off the list
+
+	LNode lnode;
+
+	ChannelWaitNode():lnode(this)
+	{
+	}
+};
+
+// Type independent part of the channels, the waiter lists and close. The items themselves go
+// through lock-free queues, the lock is only taken to queue and wake waiters
+class ChannelBase
+{
+public:
+	ChannelBase();
+	virtual ~ChannelBase();
+
+	// Wakes everybody waiting. Sends fail from now on, receives drain what is left
+	void close();
+	bool isClosed() const;
+
+protected:
+	// Whether the operation would complete (or fail on close) without blocking, a snapshot
+	virtual bool isReady(bool send) const = 0;
+	virtual ChannelResult::Enum tryOp(bool send, void* value) = 0;
+
+	ChannelResult::Enum transfer(bool send, void* value, bool wait);
+	ChannelSelectCase makeCase(bool send, void* value);
+
+	volatile int32_t m_closed;
+
+private:
+	friend int channelSelect(ChannelSelectCase* cases, int numCases, bool wait);
+
+	static int tryCases(ChannelSelectCase* cases, int numCases, int start);
+	static int waitCases(ChannelSelectCase* cases, int numCases, Fiber* fiber, Semaphore* semaphore);
+	ChannelResult::Enum complete(bool send, void* value);
+	void addWaiter(ChannelWaitNode* node, bool send);
+	void removeWaiter(ChannelWaitNode* node, bool send);
+	bool wakeOne(bool send);
+
+	Lock m_lock;
+	List<ChannelWaitNode*> m_senders;
+	List<ChannelWaitNode*> m_receivers;
+	volatile int32_t m_numSenders;      // Queued on the lists, read without the lock
+	volatile int32_t m_numReceivers;
+};
+
+// Bounded channel, send blocks while it's full and recv while it's empty
+// The capacity is rounded up to a power of two of at least 2, there are no unbuffered channels
+template <typename Ty>
+class Channel : public ChannelBase
+{
+public:
+	bool create(uint32_t _capacity)
+	{
+		m_closed = 0;
+		return m_ring.create(_capacity);
+	}
+
+	// Nobody may wait on the channel anymore
+	void destroy()
+	{
+		m_ring.destroy();
+	}
+
+	// False if the channel is closed
+	bool send(const Ty& _value)
+	{
+		return transfer(true, (void*)&_value, true) == ChannelResult::Done;
+	}
+
+	// False once the channel is closed and drained
+	bool recv(Ty* _value)
+	{
+		return transfer(false, _value, true) == ChannelResult::Done;
+	}
+
+	// Never block, false on a full (empty) channel too
+	bool trySend(const Ty& _value)
+	{
+		return transfer(true, (void*)&_value, false) == ChannelResult::Done;
+	}
+
+	bool tryRecv(Ty* _value)
+	{
+		return transfer(false, _value, false) == ChannelResult::Done;
+	}
+
+	ChannelSelectCase sendCase(const Ty* _value)
+	{
+		return makeCase(true, (void*)_value);
+	}
+
+	ChannelSelectCase recvCase(Ty* _value)
+	{
+		return makeCase(false, _value);
+	}
+
+	uint32_t getCapacity() const
+	{
+		return m_ring.getCapacity();
+	}
+
+protected:
+	virtual bool isReady(bool _send) const
+	{
+		if(atomicLoadAcquire(&m_closed))
+			return true;
+		return _send ? !m_ring.isFull() : !m_ring.isEmpty();
+	}
+
+	virtual ChannelResult::Enum tryOp(bool _send, void* _value)
+	{
+		if(_send)
+		{
+			if(atomicLoadAcquire(&m_closed))
+				return ChannelResult::Closed;
+			return m_ring.push(*(const Ty*)_value) ? ChannelResult::Done : ChannelResult::WouldBlock;
+		}
+
+		if(m_ring.pop((Ty*)_value))
+			return ChannelResult::Done;
+		if(!atomicLoadAcquire(&m_closed))
+			return ChannelResult::WouldBlock;
+
+		// A send may have landed right before the close
+		return m_ring.pop((Ty*)_value) ? ChannelResult::Done : ChannelResult::Closed;
+	}
+
+private:
+	MpmcRing<Ty> m_ring;
+};
+
+// Unbounded channel, send never blocks, recv blocks while it's empty
+template <typename Ty>
+class UnboundedChannel : public ChannelBase
+{
+public:
+	void create()
+	{
+		m_closed = 0;
+	}
+
+	// Nobody may wait on the channel anymore
+	void destroy()
+	{
+		m_queue.destroy();
+	}
+
+	// False if the channel is closed or out of memory
+	bool send(const Ty& _value)
+	{
+		return transfer(true, (void*)&_value, false) == ChannelResult::Done;
+	}
+
+	bool recv(Ty* _value)
+	{
+		return transfer(false, _value, true) == ChannelResult::Done;
+	}
+
+	// Same as send, there's nothing to wait for. For code written against both channels
+	bool trySend(const Ty& _value)
+	{
+		return transfer(true, (void*)&_value, false) == ChannelResult::Done;
+	}
+
+	bool tryRecv(Ty* _value)
+	{
+		return transfer(false, _value, false) == ChannelResult::Done;
+	}
+
+	ChannelSelectCase sendCase(const Ty* _value)
+	{
+		return makeCase(true, (void*)_value);
+	}
+
+	ChannelSelectCase recvCase(Ty* _value)
+	{
+		return makeCase(false, _value);
+	}
+
+protected:
+	virtual bool isReady(bool _send) const
+	{
+		return _send || atomicLoadAcquire(&m_closed) || !m_queue.isEmpty();
+	}
+
+	virtual ChannelResult::Enum tryOp(bool _send, void* _value)
+	{
+		if(_send)
+		{
+			if(atomicLoadAcquire(&m_closed))
+				return ChannelResult::Closed;
+			return m_queue.push(*(const Ty*)_value) ? ChannelResult::Done : ChannelResult::Closed;
+		}
+
+		if(m_queue.pop((Ty*)_value))
+			return ChannelResult::Done;
+		if(!atomicLoadAcquire(&m_closed))
+			return ChannelResult::WouldBlock;
+		return m_queue.pop((Ty*)_value) ? ChannelResult::Done : ChannelResult::Closed;
+	}
+
+private:
+	MpmcQueue<Ty> m_queue;
+};
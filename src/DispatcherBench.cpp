@@ -0,0 +1,116 @@
+#include <stdio.h>
+
+#include "BasicJobDispatcher.hpp"
+
+// Benchmarks of dispatcher configurations against each other, every one is instantiated in this
+// binary and runs the same workloads on its own workers:
+// fan-out, rounds of numJobs short jobs waited on from the calling thread
+// tree, a binary fork-join tree where every inner job waits on its two children
+
+typedef BasicJobDispatcher<PriorityQueuePolicy, Lock, Semaphore, ProfiledStackPolicy, NoTracePolicy> UntracedJobDispatcher;
+typedef BasicJobDispatcher<FifoQueuePolicy, Lock, Semaphore, ProfiledStackPolicy, StatsTracePolicy> FifoJobDispatcher;
+typedef BasicJobDispatcher<PriorityQueuePolicy, SpinLock, Semaphore, ProfiledStackPolicy, StatsTracePolicy> SpinLockJobDispatcher;
+typedef BasicJobDispatcher<PriorityQueuePolicy, Lock, SpinSemaphore, ProfiledStackPolicy, StatsTracePolicy> SpinWaitJobDispatcher;
+typedef BasicJobDispatcher<PriorityQueuePolicy, Lock, Semaphore, FixedStackPolicy, StatsTracePolicy> FixedStackJobDispatcher;
+typedef BasicJobDispatcher<FifoQueuePolicy, SpinLock, Semaphore, FixedStackPolicy, NoTracePolicy> LeanJobDispatcher;
+
+#define BENCH_ROUNDS 100
+#define BENCH_TREE_DEPTH 10
+
+static double toMs(int64_t ticks)
+{
+	return 1000.0*(double)ticks/(double)getHPFrequency();
+}
+
+static void countJob(int jobIndex, void* userParam)
+{
+	atomicFetchAndAdd((volatile int32_t*)userParam, 1);
+}
+
+template <typename Dispatcher>
+struct BenchNode
+{
+	Dispatcher* dispatcher;
+	uint32_t depth;
+	volatile int32_t* count;
+};
+
+template <typename Dispatcher>
+static void treeJob(int jobIndex, void* userParam)
+{
+	BenchNode<Dispatcher>* node = (BenchNode<Dispatcher>*)userParam;
+	atomicFetchAndAdd(node->count, 1);
+	if(node->depth == 0)
+		return;
+
+	// Both children read the same node, it lives until they are done
+	BenchNode<Dispatcher> child = { node->dispatcher, node->depth - 1, node->count };
+	JobDesc jobs[2];
+	jobs[0] = JobDesc(treeJob<Dispatcher>, &child);
+	jobs[1] = jobs[0];
+	waitJobs(dispatchSmallJobs(node->dispatcher, jobs, 2));
+}
+
+template <typename Dispatcher>
+static bool benchDispatcher(const char* name, uint16_t numJobs, const JobDispatcherDesc* desc = nullptr)
+{
+	Dispatcher* dispatcher = createBasicJobDispatcher<Dispatcher>(desc);
+	if(!dispatcher)
+	{
+		printf("%-14s failed to start\n", name);
+		return false;
+	}
+
+	JobDesc* jobs = new JobDesc[numJobs];
+	volatile int32_t count = 0;
+	for(uint16_t i = 0; i < numJobs; i++)
+		jobs[i] = JobDesc(countJob, (void*)&count);
+
+	int64_t t0 = getHPCounter();
+	for(int round = 0; round < BENCH_ROUNDS; round++)
+		waitJobs(dispatchJobs(dispatcher, jobs, numJobs));
+	int64_t t1 = getHPCounter();
+	bool ok = count == BENCH_ROUNDS*numJobs;
+
+	count = 0;
+	BenchNode<Dispatcher> root = { dispatcher, BENCH_TREE_DEPTH, &count };
+	JobDesc rootJob(treeJob<Dispatcher>, &root);
+	int64_t t2 = getHPCounter();
+	for(int round = 0; round < BENCH_ROUNDS; round++)
+		waitJobs(dispatchJobs(dispatcher, &rootJob, 1));
+	int64_t t3 = getHPCounter();
+	ok = ok && count == BENCH_ROUNDS*((2 << BENCH_TREE_DEPTH) - 1);
+
+	delete[] jobs;
+	destroyJobDispatcher(dispatcher);
+
+	double fanOutMs = toMs(t1 - t0);
+	double treeMs = toMs(t3 - t2);
+	printf("%-14s %10.2f %10.1f %10.2f %10.1f %s\n", name, fanOutMs, 1000000.0*fanOutMs/(BENCH_ROUNDS*numJobs),
+		treeMs, 1000000.0*treeMs/(BENCH_ROUNDS*((2 << BENCH_TREE_DEPTH) - 1)), ok ? "" : "MISMATCH");
+	return ok;
+}
+
+int runDispatcherBenchmarks(uint16_t numJobs)
+{
+	if(numJobs == 0)
+		numJobs = 1;
+
+	// Fan-outs of at least shardedBatchSize jobs finish on sharded counters by default
+	JobDispatcherDesc unsharded;
+	unsharded.shardedBatchSize = 0;
+	JobDispatcherDesc workFirst;
+	workFirst.flags |= JobDispatcherFlags::WorkFirstWaits;
+
+	printf("%-14s %10s %10s %10s %10s\n", "dispatcher", "fan-out ms", "ns/job", "tree ms", "ns/job");
+	bool ok = benchDispatcher<JobDispatcher>("default", numJobs);
+	ok = benchDispatcher<JobDispatcher>("no shards", numJobs, &unsharded) && ok;
+	ok = benchDispatcher<JobDispatcher>("work first", numJobs, &workFirst) && ok;
+	ok = benchDispatcher<UntracedJobDispatcher>("no trace", numJobs) && ok;
+	ok = benchDispatcher<FifoJobDispatcher>("fifo", numJobs) && ok;
+	ok = benchDispatcher<SpinLockJobDispatcher>("spin lock", numJobs) && ok;
+	ok = benchDispatcher<SpinWaitJobDispatcher>("spin wait", numJobs) && ok;
+	ok = benchDispatcher<FixedStackJobDispatcher>("fixed stacks", numJobs) && ok;
+	ok = benchDispatcher<LeanJobDispatcher>("lean", numJobs) && ok;
+	return ok ? 0 : 1;
+}
@@ -4,6 +4,7 @@
 
 #include "fcontext.h"
 #include "List.hpp"
+#include "Lock.hpp"
 
 struct JobPriority
 {
@@ -19,35 +20,89 @@ struct JobPriority
 typedef volatile int32_t JobCounter;
 typedef JobCounter* JobHandle;
 
+struct Fiber;
+struct JobDispatcherBase;
+struct ResourceClaim;
+
+#define COUNTER_DONE ((Fiber*)(uintptr_t)1)
+#define COUNTER_EXTERNAL ((uintptr_t)2)     // Tag on the waiter, a thread blocked in waitJobs instead of a fiber
+#define COUNTER_SHARD_STRIDE 64     // Bytes between the sub-counts of a sharded counter, a cache line each
+
 struct CounterContainer
 {
+	typedef List<CounterContainer*>::Node LNode;
+
+	// Jobs and drained shards left. A wide dispatch counts its jobs on shards instead, each of them
+	// counts once here until its last job finished, so their workers don't fight over this line
 	JobCounter counter;
+	Fiber* volatile waiter;     // Fiber suspended on this counter, COUNTER_DONE once the last job finished
+	JobDispatcherBase* dispatcher;  // Owner of the counter and its jobs
+	uint8_t* shards;            // Sub-counts COUNTER_SHARD_STRIDE apart, null if the jobs count on counter
+
+	// Priority inheritance, the jobs of the counter queue at least at the priority of the job
+	// waiting on it. Count while nobody does, under the dispatcher's jobLock
+	JobPriority::Enum priority;
+	JobPriority::Enum lowestQueued;     // Least urgent job ever queued on it, boosts skip the lists above
+
+	// Counters waited on by jobs of this one, a boost follows them down. A counter's children and
+	// their childNodes are under its linkLock, a walk holds the locks of its path from the top
+	CounterContainer* parent;
+	List<CounterContainer*> children;
+	LNode childNode;
+	SpinLock linkLock;
+
+	CounterContainer():childNode(this)
+	{
+	}
 };
 
 typedef void(*JobCallback)(int jobIndex, void* userParam);
 
 class FiberPool;
 
-struct Fiber
+// A dispatched job, queued until a worker picks it up
+// The fiber is bound when the job starts, so a job never needs a free fiber to be dispatched
+struct Job
 {
-	typedef List<Fiber*>::Node LNode;
+	typedef List<Job*>::Node LNode;
 
-	uint32_t ownerThread;    // by default, owner thread is 0, which indicates that thread owns this fiber
-							 // If we wait on a job (fiber), owner thread gets a valid value
-	uint16_t jobIndex;
-	uint16_t stackIndex;
+	JobCallback callback;
+	void* userData;
+	JobDispatcherBase* dispatcher;
 	JobCounter* counter;
-	JobCounter* waitCounter;
-	fcontext_t context;
-	FiberPool* ownerPool;
+	JobCounter* shard;          // Sub-count of a sharded counter the job finishes on, null for the counter itself
+	Fiber* fiber;               // Null until the job starts, then the fiber to resume after a wait
+	ResourceClaim* claim;       // Resources it declared, held until it finishes. Null for none
+	uint16_t jobIndex;
+	uint8_t stackClass;         // Smallest stack class the job may run on
+	int16_t worker;             // Only that worker starts it, -1 for any, see RecurringJobDesc::worker
+	JobPriority::Enum priority;
+	bool pinned;                // Resumes on the thread it suspended on, see JobDesc::pinned
+	bool tiny;                  // Runs in a batch on a shared fiber, see JobDesc::tiny
+	bool persistent;            // Owned by a recurring registration, never goes back to the job pool
+	int64_t dispatchTime;       // getHPCounter() at dispatch, JobDispatcherFlags::Statistics only
 
 	LNode lnode;
 
-	JobCallback callback;
-	JobPriority::Enum priority;
-	void* userData;
+	Job():lnode(this)
+	{
+	}
+};
+
+struct Fiber
+{
+	uint32_t ownerThread;       // Thread a pinned job is suspended on, 0 if any thread may resume it
+	uint16_t stackIndex;        // Slot in the pool, and the stack unless the pool is a shared-stack one
+	uint16_t sharedStack;       // Shared-stack pools, the execution stack the fiber runs on
+	uint8_t* savedStack;        // Shared-stack pools, the used part of the stack while suspended
+	uint32_t savedSize;
+	uint32_t savedCapacity;
+	JobHandle waitHandle;       // Counter the fiber is suspended on
+	fcontext_t context;         // Saved context while the fiber is not running
+	FiberPool* ownerPool;
+	Job* job;
 
-	Fiber():lnode(this)
+	Fiber()
 	{
 	}
 };
\ No newline at end of file
@@ -1,34 +1,17 @@
-#include "FiberPool.hpp"
-#include "JobDispatcher.hpp"
-
-extern JobDispatcher* g_dispatcher;
-
-static void fiberCallback(fcontext_transfer_t transfer)
-{
-	Fiber* fiber = (Fiber*)transfer.data;
-	ThreadData* data = (ThreadData*)g_dispatcher->threadData.get();
-
-	data->running = fiber;
-
-	// Call user task callback
-	fiber->callback(fiber->jobIndex, fiber->userData);
+#include <new>
+#include <stdlib.h>
+#include <string.h>
 
-	// Job is finished
-	atomicFetchAndSub(fiber->counter, 1);
-
-	data->running = nullptr;
-
-	// Delete the fiber
-	fiber->ownerPool->deleteFiber(fiber);
+#include "FiberPool.hpp"
+#include "StackGuard.hpp"
 
-	// Go back
-	jump_fcontext(transfer.ctx, transfer.data);
-}
+#define SAVED_STACK_GRANULARITY 256     // Saved stack buffers grow in steps of that many bytes
 
-bool FiberPool::create(uint16_t maxFibers, uint32_t stackSize)
+bool FiberPool::create(uint16_t maxFibers, uint32_t stackSize, bool paintStacks, fcontext_arena_t* arena, uint16_t numSharedStacks)
 {
 	// Create pool structure
-	size_t totalSize = sizeof(Fiber)*maxFibers + sizeof(Fiber*)*maxFibers + sizeof(fcontext_stack_t)*maxFibers;
+	uint16_t numStacks = numSharedStacks > 0 ? numSharedStacks : maxFibers;
+	size_t totalSize = sizeof(Fiber)*maxFibers + sizeof(fcontext_stack_t)*numStacks + sizeof(Fiber*)*numSharedStacks;
 
 	uint8_t* buff = (uint8_t*)malloc(totalSize);
 	if(!buff)
@@ -38,55 +21,82 @@ bool FiberPool::create(uint16_t maxFibers, uint32_t stackSize)
 
 	m_fibers = (Fiber*)buff;
 	buff += sizeof(Fiber)*maxFibers;
-	m_ptrs = (Fiber**)buff;
-	buff += sizeof(Fiber*)*maxFibers;
 	m_stacks = (fcontext_stack_t*)buff;
-
-	for(uint16_t i = 0; i < maxFibers; i++)
-		m_ptrs[maxFibers - i - 1] = &m_fibers[i];
+	buff += sizeof(fcontext_stack_t)*numStacks;
+	m_onStack = numSharedStacks > 0 ? (Fiber* volatile*)buff : nullptr;
 	m_maxFibers = maxFibers;
-	m_index = maxFibers;
+	m_numStacks = numStacks;
+	m_arena = arena != nullptr;
+	m_shared = numSharedStacks > 0;
+
+	if(!m_freeFibers.create(maxFibers, true))
+		return false;
 
 	// Create contexts and their stack memories
 	for(uint16_t i = 0; i < maxFibers; i++)
-	{
-		m_stacks[i] = create_fcontext_stack(stackSize);
 		m_fibers[i].stackIndex = i;
+	for(uint16_t i = 0; i < numStacks; i++)
+	{
+		m_stacks[i] = arena ? carve_fcontext_stack(arena, stackSize) : create_fcontext_stack(stackSize);
 		if(!m_stacks[i].sptr)
 			return false;
+
+		if(paintStacks)
+			paintStack(m_stacks[i]);
 	}
+	if(numStacks > 0)
+		m_stackSize = (uint32_t)(m_stacks[0].ssize - get_fcontext_guard_size());
+	m_painted = paintStacks;
 
 	return true;
 }
 
 void FiberPool::destroy()
 {
-	for(uint16_t i = 0; i < m_maxFibers; i++)
+	for(uint16_t i = 0; i < m_numStacks && !m_arena; i++)
 	{
 		if(m_stacks[i].sptr)
 			destroy_fcontext_stack(&m_stacks[i]);
 	}
 
-	// Free the whole buffer (context+ptrs+stacks)
+	// Fibers still suspended when the dispatcher went down
+	for(uint16_t i = 0; i < m_maxFibers && m_shared; i++)
+		free(m_fibers[i].savedStack);
+
+	m_freeFibers.destroy();
+
+	// Free the whole buffer (context+stacks)
 	if(m_fibers)
 		free(m_fibers);
+	m_fibers = nullptr;
+	m_stacks = nullptr;
+	m_onStack = nullptr;
+	m_maxFibers = 0;
+	m_numStacks = 0;
 }
 
-Fiber* FiberPool::newFiber(JobCallback callbackFn, void* userData, uint16_t index, JobPriority::Enum priority, FiberPool* pool, JobCounter* counter)
+Fiber* FiberPool::newFiber(Job* job, int sharedStack)
 {
-	LockScope lk(m_lock);
-	if(m_index > 0)
+	if(m_shared && (sharedStack < 0 || sharedStack >= m_numStacks))
+		return nullptr;
+
+	int32_t slot = m_freeFibers.pop();
+	if(slot >= 0)
 	{
-		Fiber* fiber = new(m_ptrs[--m_index]) Fiber();
+		Fiber* fiber = new(&m_fibers[slot]) Fiber();
+		fiber->stackIndex = (uint16_t)slot;
+		fiber->sharedStack = (uint16_t)(sharedStack < 0 ? 0 : sharedStack);
+		fiber->savedStack = nullptr;
+		fiber->savedSize = 0;
+		fiber->savedCapacity = 0;
 		fiber->ownerThread = 0;
-		fiber->context = make_fcontext(m_stacks[fiber->stackIndex].sptr, m_stacks[fiber->stackIndex].ssize, fiberCallback);
-		fiber->callback = callbackFn;
-		fiber->userData = userData;
-		fiber->jobIndex = index;
-		fiber->waitCounter = &g_dispatcher->dummyCounter;
-		fiber->counter = counter;
-		fiber->priority = priority;
-		fiber->ownerPool = pool;
+		fiber->context = nullptr;
+		fiber->ownerPool = this;
+		fiber->job = job;
+		job->fiber = fiber;
+
+		int32_t inUse = atomicFetchAndAdd(&m_inUse, 1) + 1;
+		atomicMax(&m_peakInUse, inUse);
 		return fiber;
 	}
 	else
@@ -95,8 +105,82 @@ Fiber* FiberPool::newFiber(JobCallback callbackFn, void* userData, uint16_t inde
 	}
 }
 
+void FiberPool::makeContext(Fiber* fiber, pfn_fcontext entry)
+{
+	const fcontext_stack_t& stack = getStack(fiber);
+	fiber->context = make_fcontext(stack.sptr, stack.ssize, entry);
+	if(m_shared)
+		m_onStack[fiber->sharedStack] = fiber;
+}
+
 void FiberPool::deleteFiber(Fiber* fiber)
 {
-	LockScope lk(m_lock);
-	m_ptrs[m_index++] = fiber;
+	if(fiber->savedStack)
+	{
+		free(fiber->savedStack);
+		fiber->savedStack = nullptr;
+		atomicFetchAndSub(&m_savedBytes, (int32_t)fiber->savedCapacity);
+	}
+	atomicFetchAndSub(&m_inUse, 1);
+	m_freeFibers.push(fiber->stackIndex);
+}
+
+// The saved context sits at the stack pointer, everything below it is dead
+void FiberPool::copyOut(Fiber* fiber)
+{
+	const fcontext_stack_t& stack = getStack(fiber);
+	uint32_t used = (uint32_t)((uint8_t*)stack.sptr - (uint8_t*)fiber->context);
+	if(used > fiber->savedCapacity)
+	{
+		// The buffer is kept until the fiber is released, a deeper wait only grows it
+		uint32_t capacity = (used + SAVED_STACK_GRANULARITY - 1) & ~(SAVED_STACK_GRANULARITY - 1);
+		uint8_t* buffer = (uint8_t*)malloc(capacity);
+
+		// The fiber is off its stack already, there's no way back to fail the wait
+		if(!buffer)
+			abort();
+		free(fiber->savedStack);
+		atomicFetchAndAdd(&m_savedBytes, (int32_t)(capacity - fiber->savedCapacity));
+		fiber->savedStack = buffer;
+		fiber->savedCapacity = capacity;
+	}
+	memcpy(fiber->savedStack, fiber->context, used);
+	fiber->savedSize = used;
+}
+
+void FiberPool::copyIn(Fiber* fiber)
+{
+	const fcontext_stack_t& stack = getStack(fiber);
+	memcpy((uint8_t*)stack.sptr - fiber->savedSize, fiber->savedStack, fiber->savedSize);
+	m_onStack[fiber->sharedStack] = fiber;
+}
+
+// A shared stack also shows the depth of the fibers that were suspended on it since the last measure
+uint32_t FiberPool::measureStack(Fiber* fiber)
+{
+	uint32_t used = ::measureStack(getStack(fiber));
+
+	atomicMax(&m_peakUsage, (int32_t)used);
+	return used;
+}
+
+Fiber* FiberPool::findGuardFiber(const void* addr) const
+{
+	// Also match the page right below the guard, Windows guard pages are one-shot
+	// and a second overflow lands under the stack
+	size_t guard = get_fcontext_guard_size();
+	for(uint16_t i = 0; i < m_numStacks; i++)
+	{
+		const uint8_t* low = (const uint8_t*)m_stacks[i].sptr - m_stacks[i].ssize;
+		if((const uint8_t*)addr >= low - guard && (const uint8_t*)addr < low + guard)
+			return m_shared ? m_onStack[i] : &m_fibers[i];
+	}
+	return nullptr;
+}
+
+uint32_t FiberPool::getStackRoom(const Fiber* fiber, const void* addr) const
+{
+	const fcontext_stack_t& stack = getStack(fiber);
+	const uint8_t* low = (const uint8_t*)stack.sptr - stack.ssize + get_fcontext_guard_size();
+	return (const uint8_t*)addr > low ? (uint32_t)((const uint8_t*)addr - low) : 0;
 }
\ No newline at end of file
@@ -1,40 +1,141 @@
 #pragma once
 
 #include "Fiber.hpp"
-#include "Lock.hpp"
+#include "IndexStack.hpp"
 
+#define MAX_STACK_CLASSES 8
+
+// Fixed set of fibers with their stacks
+// Free fibers are kept in a lock-free index stack (by stackIndex), so newFiber/deleteFiber are O(1)
+// and never block each other. Context setup (makeContext) is separate, so it can run outside of any lock
+// A shared-stack pool has no stack per fiber, its fibers run on a few execution stacks and only the
+// part they use is copied out while they are suspended. A suspended fiber takes memory for its actual
+// depth, and has to be resumed on the same execution stack since its frames point into it
 class FiberPool
 {
 private:
 	Fiber * m_fibers;
-	Fiber** m_ptrs;
 	fcontext_stack_t* m_stacks;
+	Fiber* volatile* m_onStack;    // Shared-stack pools, last fiber started or resumed on each execution stack
 
 	uint16_t m_maxFibers;
-	int32_t m_index;
+	uint16_t m_numStacks;
+	uint32_t m_stackSize;
+	volatile int32_t m_peakUsage;   // Deepest measured stack use over all fibers
+	volatile int32_t m_inUse;
+	volatile int32_t m_peakInUse;
+	volatile int32_t m_savedBytes;  // Buffers of the fibers of a shared-stack pool
+	bool m_painted;
+	bool m_arena;       // Stacks belong to a stack arena, released with it
+	bool m_shared;
+	IndexStack m_freeFibers;
 
-	Lock m_lock;
+	inline const fcontext_stack_t& getStack(const Fiber* fiber) const
+	{
+		return m_stacks[m_shared ? fiber->sharedStack : fiber->stackIndex];
+	}
+
+	void copyOut(Fiber* fiber);
+	void copyIn(Fiber* fiber);
 
 public:
 	FiberPool()
 	{
 		m_fibers = nullptr;
 		m_stacks = nullptr;
+		m_onStack = nullptr;
 		m_maxFibers = 0;
-		m_index = 0;
-		m_ptrs = nullptr;
+		m_numStacks = 0;
+		m_stackSize = 0;
+		m_peakUsage = 0;
+		m_inUse = 0;
+		m_peakInUse = 0;
+		m_savedBytes = 0;
+		m_painted = false;
+		m_arena = false;
+		m_shared = false;
 	}
 
-	bool create(uint16_t maxFibers, uint32_t stackSize);
+	// paintStacks: fill stacks with a pattern so the depth reached by each job can be measured
+	// arena: carve stacks from it instead of mapping each one
+	// numSharedStacks: make a shared-stack pool with that many execution stacks, 0 for a stack per fiber
+	bool create(uint16_t maxFibers, uint32_t stackSize, bool paintStacks = false, fcontext_arena_t* arena = nullptr,
+		uint16_t numSharedStacks = 0);
 
 	void destroy();
 
-	Fiber* newFiber(JobCallback callbackFn, void* userData, uint16_t index, JobPriority::Enum priority, FiberPool* pool, JobCounter* counter);
+	// Binds a free fiber to the job, returns nullptr if the pool is exhausted
+	// A shared-stack pool needs the execution stack the fiber will run on, it has none for -1
+	Fiber* newFiber(Job* job, int sharedStack = -1);
+
+	// Sets up a fresh context on the fiber's stack that starts in entry
+	void makeContext(Fiber* fiber, pfn_fcontext entry);
 
 	void deleteFiber(Fiber* fiber);
 
+	// Shared-stack pools, from off the fiber's stack: saves what it uses once its context is saved,
+	// and copies it back before the fiber is resumed. Nothing else may run on the stack in between
+	inline void saveStack(Fiber* fiber)
+	{
+		if(m_shared)
+			copyOut(fiber);
+	}
+
+	inline void restoreStack(Fiber* fiber)
+	{
+		if(m_shared)
+			copyIn(fiber);
+	}
+
+	// Returns the usable stack depth of the fiber's stack and repaints it, pool must be painted
+	uint32_t measureStack(Fiber* fiber);
+
+	// Returns the fiber whose stack guard region contains addr, or nullptr
+	Fiber* findGuardFiber(const void* addr) const;
+
+	// Bytes between addr, on the running fiber's stack, and its guard region
+	uint32_t getStackRoom(const Fiber* fiber, const void* addr) const;
+
 	inline uint16_t getMax() const
 	{
 		return m_maxFibers;
 	}
+
+	// Usable stack size, guard page excluded
+	inline uint32_t getStackSize() const
+	{
+		return m_stackSize;
+	}
+
+	inline bool isPainted() const
+	{
+		return m_painted;
+	}
+
+	inline bool isShared() const
+	{
+		return m_shared;
+	}
+
+	inline uint32_t getPeakStackUsage() const
+	{
+		return (uint32_t)m_peakUsage;
+	}
+
+	inline uint32_t getNumInUse() const
+	{
+		return (uint32_t)m_inUse;
+	}
+
+	// Most fibers bound at the same time since creation
+	inline uint32_t getPeakInUse() const
+	{
+		return (uint32_t)m_peakInUse;
+	}
+
+	// Heap memory the bound fibers of a shared-stack pool keep their stacks in
+	inline uint32_t getSavedStackBytes() const
+	{
+		return (uint32_t)m_savedBytes;
+	}
 };
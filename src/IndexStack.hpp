@@ -0,0 +1,109 @@
+#pragma once
+
+#include <stdint.h>
+#include <malloc.h>
+
+#include "Lock.hpp"
+
+// Lock-free LIFO of integer indices (Treiber stack)
+// Links live in a side array indexed by the items themselves, and the head packs a
+// modification tag next to the top index. An index that is popped and pushed back
+// between another thread's read and CAS changes the tag, so that CAS fails (no ABA)
+class IndexStack
+{
+public:
+	IndexStack()
+	{
+		m_head = makeHead(-1, 0);
+		m_next = nullptr;
+		m_maxItems = 0;
+	}
+
+	bool create(int32_t _maxItems, bool _fill = false)
+	{
+		m_next = (volatile int32_t*)malloc(sizeof(int32_t)*_maxItems);
+		if(!m_next)
+			return false;
+		m_maxItems = _maxItems;
+		m_head = makeHead(-1, 0);
+
+		if(_fill)
+		{
+			// Index 0 ends up on top
+			for(int32_t i = _maxItems - 1; i >= 0; i--)
+				push(i);
+		}
+		return true;
+	}
+
+	void destroy()
+	{
+		if(m_next)
+		{
+			free((void*)m_next);
+			m_next = nullptr;
+		}
+		m_maxItems = 0;
+		m_head = makeHead(-1, 0);
+	}
+
+	void push(int32_t _index)
+	{
+		int64_t head, newHead;
+		do
+		{
+			head = m_head;
+			m_next[_index] = getIndex(head);
+			newHead = makeHead(_index, getTag(head) + 1);
+		} while(atomicCompareAndSwap(&m_head, head, newHead) != head);
+	}
+
+	// Returns -1 if the stack is empty
+	int32_t pop()
+	{
+		int64_t head, newHead;
+		do
+		{
+			head = m_head;
+			int32_t index = getIndex(head);
+			if(index < 0)
+				return -1;
+
+			// m_next[index] may be stale if another thread got here first, the tag check catches it
+			newHead = makeHead(m_next[index], getTag(head) + 1);
+		} while(atomicCompareAndSwap(&m_head, head, newHead) != head);
+
+		return getIndex(head);
+	}
+
+	bool isEmpty() const
+	{
+		return getIndex(m_head) < 0;
+	}
+
+	int32_t getMaxItems() const
+	{
+		return m_maxItems;
+	}
+
+private:
+	static int64_t makeHead(int32_t _index, uint32_t _tag)
+	{
+		return (int64_t)(((uint64_t)_tag << 32) | (uint32_t)_index);
+	}
+
+	static int32_t getIndex(int64_t _head)
+	{
+		return (int32_t)(uint32_t)((uint64_t)_head & 0xffffffff);
+	}
+
+	static uint32_t getTag(int64_t _head)
+	{
+		return (uint32_t)((uint64_t)_head >> 32);
+	}
+
+private:
+	volatile int64_t m_head;
+	volatile int32_t* m_next;
+	int32_t m_maxItems;
+};
@@ -1,308 +1,809 @@
-#include <thread>
+#include <stdio.h>
 
 #include <malloc.h>
 #include <memory>
 
-#include "JobDispatcher.hpp"
+#include "BasicJobDispatcher.hpp"
 
 JobDispatcher* g_dispatcher = nullptr;
+JobDispatcherBase* volatile g_dispatchers[MAX_JOB_DISPATCHERS];     // Every live dispatcher, for the stack guard
 
-static ThreadData* createThreadData(uint32_t threadId, bool main)
+static TlsData s_threadData;
+static Lock s_registryLock;
+
+ThreadData* getThreadData()
+{
+	return (ThreadData*)s_threadData.get();
+}
+
+// Worker thread data is created up front on the creating thread, attachThreadData finishes
+// the setup on the owning thread
+ThreadData* createThreadData(JobDispatcherBase* dispatcher, bool main)
 {
 	ThreadData* data = new ThreadData();
 	if(!data)
 		return nullptr;
+	data->dispatcher = dispatcher;
 	data->main = main;
-	data->threadId = threadId;
-	memset(data->stacks, 0x00, sizeof(fcontext_stack_t)*MAX_WAIT_STACKS);
+	return data;
+}
+
+void attachThreadData(ThreadData* data)
+{
+	data->threadId = Thread::getTid();
+	s_threadData.set(data);
+}
+
+// The data stays, a worker slot's is reused by the next thread on it
+void detachThreadData(ThreadData* data)
+{
+	s_threadData.set(nullptr);
+}
+
+void attachSignalStack(ThreadData* data, const JobDispatcherBase* dispatcher)
+{
+	if((dispatcher->flags & JobDispatcherFlags::StackOverflowHandler) && !data->signalStack)
+		data->signalStack = createSignalStack();
+}
+
+// Must run on the owning thread (signal stack)
+void destroyThreadData(ThreadData* data)
+{
+	s_threadData.set(nullptr);
+	destroySignalStack(data->signalStack);
+	delete data;
+}
+
+// A thread blocked in waitJobs, the last job posts it
+struct ExternalWaiter
+{
+	Semaphore semaphore;
+};
+
+static void deleteRecurringJob(RecurringJob* recurring)
+{
+	delete[] recurring->jobs;
+	delete recurring;
+}
+
+// Runs on the scheduler stack once the waiting fiber's context is saved, so whoever finishes
+// the last child can't resume it before it is fully off its stack
+static fcontext_transfer_t suspendFiber(fcontext_transfer_t transfer)
+{
+	Fiber* fiber = (Fiber*)transfer.data;
+	fiber->context = transfer.ctx;
+	fiber->ownerPool->saveStack(fiber);
+
+	CounterContainer* container = (CounterContainer*)fiber->waitHandle;
+	if(atomicCompareAndSwapPtr((void* volatile*)&container->waiter, nullptr, fiber) != nullptr)
+	{
+		// Children finished in the meantime
+		readyJob(fiber->job);
+	}
+	return transfer;
+}
+
+struct ParkRequest
+{
+	Fiber* fiber;
+	FiberParkCallback onPark;
+	void* userParam;
+};
+
+// The job goes behind the others of its priority once its fiber is off its stack
+static fcontext_transfer_t yieldHook(fcontext_transfer_t transfer)
+{
+	Fiber* fiber = (Fiber*)transfer.data;
+	fiber->context = transfer.ctx;
+	fiber->ownerPool->saveStack(fiber);
+	readyJob(fiber->job);
+	return transfer;
+}
+
+// Like suspendFiber, but the caller decides who gets the fiber. The request lives on the parked
+// stack, onPark may hand the fiber over and it must not be touched afterwards
+static fcontext_transfer_t parkHook(fcontext_transfer_t transfer)
+{
+	ParkRequest* request = (ParkRequest*)transfer.data;
+	Fiber* fiber = request->fiber;
+	fiber->context = transfer.ctx;
+	fiber->ownerPool->saveStack(fiber);    // The request is still on the stack, only this thread resumes the fiber
+	request->onPark(fiber, request->userParam);
+	return transfer;
+}
 
-	for(int i = 0; i < MAX_WAIT_STACKS; i++)
+// Takes count finished jobs off the counter, or off their shard and the drained shard off the counter
+// Returns the fiber waiting on it if they were the last ones, the counter may be gone right after
+// since a plain thread waiter doesn't wait for that
+Fiber* finishJobs(JobCounter* counter, int32_t count, JobCounter* shard)
+{
+	if(shard)
 	{
-		data->stacks[i] = create_fcontext_stack(WAIT_STACK_SIZE);
-		if(!data->stacks[i].sptr)
+		if(atomicFetchAndSub(shard, count) != count)
 			return nullptr;
+		count = 1;
 	}
+	if(atomicFetchAndSub(counter, count) != count)
+		return nullptr;
 
-	return data;
+	CounterContainer* container = (CounterContainer*)counter;
+	Fiber* waiter = (Fiber*)atomicExchangePtr((void* volatile*)&container->waiter, COUNTER_DONE);
+	if((uintptr_t)waiter & COUNTER_EXTERNAL)
+	{
+		// A blocked thread, it's gone as soon as it's posted
+		((ExternalWaiter*)((uintptr_t)waiter & ~COUNTER_EXTERNAL))->semaphore.post();
+		return nullptr;
+	}
+	return waiter;
 }
 
-static void destroyThreadData(ThreadData* data)
+bool registerJobDispatcher(JobDispatcherBase* dispatcher)
 {
-	for(int i = 0; i < MAX_WAIT_STACKS; i++)
+	bool registered = false;
+	s_registryLock.lock();
+	for(int i = 0; i < MAX_JOB_DISPATCHERS && !registered; i++)
 	{
-		if(data->stacks[i].sptr)
-			destroy_fcontext_stack(&data->stacks[i]);
+		if(!g_dispatchers[i])
+		{
+			g_dispatchers[i] = dispatcher;
+			registered = true;
+		}
 	}
-	delete data;
+
+	// The fault handler is process-wide, installs are counted
+	if(registered && (dispatcher->flags & JobDispatcherFlags::StackOverflowHandler) && !installStackGuard())
+		dispatcher->flags &= ~JobDispatcherFlags::StackOverflowHandler;
+	s_registryLock.unlock();
+	return registered;
 }
 
-static fcontext_stack_t* pushWaitStack(ThreadData* data)
+void unregisterJobDispatcher(JobDispatcherBase* dispatcher)
 {
-	if(data->stackIdx == MAX_WAIT_STACKS)
-		return nullptr;
-	return &data->stacks[data->stackIdx++];
+	s_registryLock.lock();
+	for(int i = 0; i < MAX_JOB_DISPATCHERS; i++)
+	{
+		if(g_dispatchers[i] == dispatcher)
+		{
+			g_dispatchers[i] = nullptr;
+			if(dispatcher->flags & JobDispatcherFlags::StackOverflowHandler)
+				uninstallStackGuard();
+		}
+	}
+	s_registryLock.unlock();
 }
 
-static fcontext_stack_t* popWaitStack(ThreadData* data)
+JobDispatcher* createJobDispatcher(const JobDispatcherDesc* desc)
 {
-	if(data->stackIdx == 0)
-		return nullptr;
-	return &data->stacks[--data->stackIdx];
+	return createBasicJobDispatcher<JobDispatcher>(desc);
+}
+
+// Must run on the thread that created the dispatcher
+void destroyJobDispatcher(JobDispatcher* dispatcher)
+{
+	destroyJobDispatcher<JobDispatcher>(dispatcher);
+}
+
+bool setWorkerCount(JobDispatcher* dispatcher, uint8_t count)
+{
+	return setWorkerCount<JobDispatcher>(dispatcher, count);
 }
 
-static void jobPusherCallback(fcontext_transfer_t transfer)
+uint8_t getWorkerCount(const JobDispatcherBase* dispatcher)
 {
-	ThreadData* data = (ThreadData*)transfer.data;
+	return (uint8_t)dispatcher->numActiveThreads;
+}
 
-	while(!g_dispatcher->stop)
+bool initJobDispatcher(const JobDispatcherDesc* desc)
+{
+	if(g_dispatcher)
 	{
-		// Wait for a job to be placed in the job queue
-		if(!data->main)
-			g_dispatcher->semaphore.wait();     // Decreases list counter on continue
+		return false;
+	}
+	g_dispatcher = createJobDispatcher(desc);
+	return g_dispatcher != nullptr;
+}
 
-		Fiber* fiber = nullptr;
-		bool listNotEmpty = false;
-		g_dispatcher->jobLock.lock();
+void shutdownJobDispatcher()
+{
+	destroyJobDispatcher(g_dispatcher);
+	g_dispatcher = nullptr;
+}
+
+JobHandle dispatchJobs(JobDispatcher* dispatcher, const JobDesc* jobs, uint16_t numJobs)
+{
+	return dispatch(dispatcher, jobs, numJobs, -1);
+}
+
+JobHandle dispatchSmallJobs(JobDispatcher* dispatcher, const JobDesc* jobs, uint16_t numJobs)
+{
+	return dispatch(dispatcher, jobs, numJobs, dispatcher->smallStackClass);
+}
+
+JobHandle dispatchBigJobs(JobDispatcher* dispatcher, const JobDesc* jobs, uint16_t numJobs)
+{
+	return dispatch(dispatcher, jobs, numJobs, dispatcher->bigStackClass);
+}
+
+JobHandle dispatchJobs(const JobDesc* jobs, uint16_t numJobs)
+{
+	return dispatchJobs(g_dispatcher, jobs, numJobs);
+}
+
+JobHandle dispatchSmallJobs(const JobDesc* jobs, uint16_t numJobs)
+{
+	return dispatchSmallJobs(g_dispatcher, jobs, numJobs);
+}
+
+JobHandle dispatchBigJobs(const JobDesc* jobs, uint16_t numJobs)
+{
+	return dispatchBigJobs(g_dispatcher, jobs, numJobs);
+}
+
+bool appendJobs(const JobDesc* jobs, uint16_t numJobs)
+{
+	// The calling job keeps the counter above zero, so it can't be released under us
+	ThreadData* data = getThreadData();
+	if(!data || !data->running)
+		return false;
+
+	Job* job = data->running->job;
+	return job->dispatcher->hooks->queueJobs(job->dispatcher, job->counter, jobs, numJobs, -1) == numJobs;
+}
+
+// Raises the counter and the ones its waiting jobs are suspended on, all the way down. A counter
+// is never less urgent than the ones below it, so the walk stops where one was high enough
+// Walks the links instead of recursing, it runs on the waiting fiber's stack. A counter is
+// raised before its lock is taken, the locks of the path are held from the top down and a child
+// can't be unlinked while its parent's lock is held
+static void boostCounter(CounterContainer* root, JobPriority::Enum priority)
+{
+	if(!root->dispatcher->hooks->raiseCounter(root, priority))
+		return;
+
+	CounterContainer* container = root;
+	container->linkLock.lock();
+	for(;;)
+	{
+		// Down to the first child that was raised
+		CounterContainer::LNode* child = container->children.getFirst();
+		while(child && !child->data->dispatcher->hooks->raiseCounter(child->data, priority))
+			child = child->next;
+		if(child)
+		{
+			container = child->data;
+			container->linkLock.lock();
+			continue;
+		}
+
+		// Next raised sibling, climbing up as far as needed
+		for(;;)
 		{
-			for(int i = 0; i < JobPriority::Count && !fiber; i++)
+			if(container == root)
 			{
-				List<Fiber*>& list = g_dispatcher->waitList[i];
-				Fiber::LNode* node = list.getFirst();
-				while(node)
-				{
-					listNotEmpty = true;
-					Fiber* f = node->data;
-					if(*f->waitCounter == 0)
-					{     // Fiber is not waiting for any child tasks
-						if(f->ownerThread == 0 || f->ownerThread == data->threadId)
-						{
-							// Job is ready to run, pull it from the wait list
-							fiber = f;
-							list.remove(node);
-							break;
-						}
-					}
-					node = node->next;
-				}
+				root->linkLock.unlock();
+				return;
+			}
+			CounterContainer* parent = container->parent;
+			CounterContainer::LNode* next = container->childNode.next;
+			container->linkLock.unlock();
+			while(next && !next->data->dispatcher->hooks->raiseCounter(next->data, priority))
+				next = next->next;
+			if(next)
+			{
+				container = next->data;
+				container->linkLock.lock();
+				break;
 			}
+			container = parent;
 		}
-		g_dispatcher->jobLock.unlock();
+	}
+}
+
+// The job is about to wait on the counter, which inherits its priority until it's released
+// Linked first, a boost of the job's own counter from now on reaches it. Nothing is linked
+// where no boost could raise the counter any further
+static void linkWait(Job* job, CounterContainer* container)
+{
+	if(peekCounterPriority(container) == JobPriority::High)
+		return;
+
+	CounterContainer* parent = (CounterContainer*)job->counter;
+	parent->linkLock.lock();
+	container->parent = parent;
+	parent->children.addToEnd(&container->childNode);
+	parent->linkLock.unlock();
+
+	// The running job's own priority doesn't change, a stale inherited one is less urgent and a
+	// boost of the job's counter that raced with the link goes on to this one
+	JobPriority::Enum inherited = peekCounterPriority(parent);
+	JobPriority::Enum priority = inherited < job->priority ? inherited : job->priority;
+	if(priority < peekCounterPriority(container))
+		boostCounter(container, priority);
+}
+
+static void unlinkWait(CounterContainer* container)
+{
+	CounterContainer* parent = container->parent;
+	if(!parent)
+		return;
+
+	parent->linkLock.lock();
+	parent->children.remove(&container->childNode);
+	container->parent = nullptr;
+	parent->linkLock.unlock();
+}
+
+// Only pinned fibers remember the thread, the others go to whichever worker picks them up
+static void prepareSuspend(ThreadData* data, Fiber* fiber)
+{
+	bool pinned = isPinned(fiber);
+	fiber->ownerThread = pinned ? data->threadId : 0;
+	if(pinned)
+		data->pinnedFibers++;
+	data->counters.fibersSuspended++;
+}
+
+// Thread data is looked up again, the fiber may have moved
+static void finishResume(Fiber* fiber, fcontext_transfer_t transfer)
+{
+	ThreadData* data = getThreadData();
+	data->schedulerContext = transfer.ctx;
+	data->running = fiber;
+	if(isPinned(fiber))
+		data->pinnedFibers--;
+	data->counters.fibersResumed++;
+}
+
+// Returns once the counter is released, the caller still owns it
+static void waitCounter(CounterContainer* container)
+{
+	ThreadData* data = getThreadData();
+	JobDispatcherBase* dispatcher = container->dispatcher;
+	JobHandle handle = &container->counter;
 
-		if(fiber)
+	if(!data)
+	{
+		// A thread no dispatcher knows, it can't run jobs. It sleeps until the last one posts it
+		ExternalWaiter waiter;
+		Fiber* tagged = (Fiber*)((uintptr_t)&waiter | COUNTER_EXTERNAL);
+		if(atomicCompareAndSwapPtr((void* volatile*)&container->waiter, nullptr, tagged) == nullptr)
+			waiter.semaphore.wait();
+	}
+	else if(data->running)
+	{
+		// Called inside a running job, park its fiber on the counter and go back to the
+		// scheduler, the last child puts it back in the job list. Nothing new gets created
+		// per wait, so waits nest as deep as the fiber pools go
+		if(container->waiter != COUNTER_DONE)
 		{
-			// If jobPusher is called within another 'Wait' call, get back to it's context, which should be the same working thread
-			// Else just run the job from beginning
-			if(fiber->ownerThread)
+			Fiber* fiber = data->running;
+			linkWait(fiber->job, container);
+			if((dispatcher->flags & JobDispatcherFlags::WorkFirstWaits) && fiber->job->dispatcher == dispatcher &&
+				fiber->ownerPool->getStackRoom(fiber, &fiber) >= WORK_FIRST_STACK_ROOM)
 			{
-				fiber->ownerThread = 0;
-				jump_fcontext(transfer.ctx, transfer.data);
+				// The children nobody took yet run here before anything else, nested waits do the
+				// same further down the stack. It suspends only for the ones running elsewhere
+				while(container->waiter != COUNTER_DONE && dispatcher->hooks->runChildJob(dispatcher, fiber, container))
+				{
+				}
+				data = getThreadData();
 			}
-			else
+
+			while(container->waiter != COUNTER_DONE)
 			{
-				jump_fcontext(fiber->context, fiber);
+				fiber->waitHandle = handle;
+				data->running = nullptr;
+				prepareSuspend(data, fiber);
+
+				fcontext_transfer_t transfer = ontop_fcontext(data->schedulerContext, fiber, suspendFiber);
+
+				// Resumed by a scheduler, unless pinned it may run on another thread than the one we left
+				finishResume(fiber, transfer);
+				if(atomicLoadAcquirePtr((void* const volatile*)&container->waiter) == COUNTER_DONE)
+					break;
+
+				// Taken off the counter by a worker that had no fiber for our children, see helpWaiter
+				// They run on this stack, then we wait again for the ones that started elsewhere
+				while(container->waiter != COUNTER_DONE && dispatcher->hooks->runChildJob(dispatcher, fiber, container))
+				{
+				}
+				data = getThreadData();
 			}
+			unlinkWait(container);
 		}
-		else if(!data->main && listNotEmpty)
+	}
+	else
+	{
+		// Plain thread, it runs jobs of the counter's dispatcher itself until the counter is released
+		// The waiter slot is polled instead of the counter, it's the last thing the finishing job touches
+		while(container->waiter != COUNTER_DONE)
 		{
-			g_dispatcher->semaphore.post(); // Increase the list counter because we didn't pull any jobs
+			bool listNotEmpty;
+			dispatcher->hooks->runNextJob(dispatcher, data, &listNotEmpty);
 		}
-
-		// In the main thread, we have to quit the loop and get back to the caller
-		if(data->main)
-			break;
 	}
+}
+
+void waitJobs(JobHandle handle)
+{
+	if(!handle)
+		return;
 
-	// Back to main thread func
-	jump_fcontext(transfer.ctx, transfer.data);
+	CounterContainer* container = (CounterContainer*)handle;
+	JobDispatcherBase* dispatcher = container->dispatcher;
+	waitCounter(container);
+
+	// Delete the counter, the shards were done with before it was released
+	if(container->shards)
+		alignedFree(container->shards);
+	dispatcher->counterLock.lock();
+	dispatcher->counterPool.deleteInstance(container);
+	dispatcher->counterLock.unlock();
 }
 
-static int32_t threadFunc(void* userData)
+bool registerExternalThread(JobDispatcherBase* dispatcher)
 {
-	// Initialize thread data
-	ThreadData* data = createThreadData(Thread::getTid(), false);
+	if(!dispatcher || getThreadData())
+		return false;
+
+	ThreadData* data = createThreadData(dispatcher, false);
 	if(!data)
-		return -1;
-	g_dispatcher->threadData.set(data);
+		return false;
+	data->external = true;
+	attachThreadData(data);
+	attachSignalStack(data, dispatcher);
+	return true;
+}
+
+void unregisterExternalThread()
+{
+	ThreadData* data = getThreadData();
+	if(data && data->external)
+	{
+		// Jobs it queued or ran went through its magazines
+		data->dispatcher->jobPool.flushCache();
+		data->dispatcher->resources.flushCache();
+		destroyThreadData(data);
+	}
+}
 
-	fcontext_stack_t* stack = pushWaitStack(data);
-	fcontext_t threadCtx = make_fcontext(stack->sptr, stack->ssize, jobPusherCallback);
-	jump_fcontext(threadCtx, data);
+Fiber* getRunningFiber()
+{
+	ThreadData* data = getThreadData();
+	return data ? data->running : nullptr;
+}
 
-	destroyThreadData(data);
-	return 0;
+void parkFiber(FiberParkCallback onPark, void* userParam)
+{
+	ThreadData* data = getThreadData();
+	Fiber* fiber = data->running;
+	data->running = nullptr;
+	prepareSuspend(data, fiber);
+
+	ParkRequest request;
+	request.fiber = fiber;
+	request.onPark = onPark;
+	request.userParam = userParam;
+	fcontext_transfer_t transfer = ontop_fcontext(data->schedulerContext, &request, parkHook);
+
+	finishResume(fiber, transfer);
 }
 
-bool initJobDispatcher()
+void unparkFiber(Fiber* fiber)
 {
-	if(g_dispatcher)
-	{
+	readyJob(fiber->job);
+}
+
+bool yieldJob()
+{
+	ThreadData* data = getThreadData();
+	if(!data || !data->running)
 		return false;
-	}
-	g_dispatcher = new JobDispatcher();
-	if(!g_dispatcher)
+
+	Fiber* fiber = data->running;
+	data->running = nullptr;
+	prepareSuspend(data, fiber);
+	fcontext_transfer_t transfer = ontop_fcontext(data->schedulerContext, fiber, yieldHook);
+	finishResume(fiber, transfer);
+	return true;
+}
+
+bool yieldIfHigherPriorityPending()
+{
+	ThreadData* data = getThreadData();
+	if(!data || !data->running)
 		return false;
 
-	// Main thread data and stack
-	g_dispatcher->mainStack = create_fcontext_stack(8 * 1024);
-	if(!g_dispatcher->mainStack.sptr)
-	{
+	// Lists are ordered most urgent first, the ones before the job's own are what it would yield to
+	Job* job = data->running->job;
+	JobPriority::Enum inherited = peekCounterPriority((CounterContainer*)job->counter);
+	JobPriority::Enum priority = inherited < job->priority ? inherited : job->priority;
+	int32_t higher = (1 << job->dispatcher->priorityList[priority]) - 1;
+	if((atomicLoadAcquire(&job->dispatcher->pendingLists) & higher) == 0)
 		return false;
-	}
+	return yieldJob();
+}
 
-	ThreadData* mainData = createThreadData(Thread::getTid(), true);
-	if(!mainData)
+bool runPendingJob()
+{
+	ThreadData* data = getThreadData();
+	if(!data || data->running || !data->dispatcher)
 		return false;
-	g_dispatcher->threadData.set(mainData);
 
-	// Create fibers with stack memories
-	uint32_t maxSmallFibers = DEFAULT_MAX_SMALL_FIBERS;
-	uint32_t maxBigFibers = DEFAULT_MAX_BIG_FIBERS;
-	uint32_t smallFiberStackSize = DEFAULT_SMALL_STACKSIZE;
-	uint32_t bigFiberStackSize = DEFAULT_BIG_STACKSIZE;
+	bool listNotEmpty;
+	return data->dispatcher->hooks->runNextJob(data->dispatcher, data, &listNotEmpty);
+}
+
+bool canRunPendingJobs()
+{
+	ThreadData* data = getThreadData();
+	return data && !data->running && data->dispatcher;
+}
 
-	if(!g_dispatcher->counterPool.create(maxSmallFibers + maxBigFibers) ||
-		!g_dispatcher->bigFibers.create(maxBigFibers, bigFiberStackSize) ||
-		!g_dispatcher->smallFibers.create(maxSmallFibers, smallFiberStackSize))
+// Due now, catching up on missed periods doesn't burst, they are dropped. Caller holds recurringLock
+bool isRecurringJobDue(RecurringJob* recurring, int64_t now)
+{
+	if(recurring->desc.trigger == RecurringTrigger::Tick)
 	{
-		return false;
+		if(++recurring->tickCount < recurring->desc.interval)
+			return false;
+		recurring->tickCount = 0;
+		return true;
 	}
 
-	// Create threads
-
-	uint32_t numCores = std::thread::hardware_concurrency();
-	uint32_t numWorkerThreads = min(numCores ? (numCores - 1) : 0, UINT8_MAX);
+	if(now < recurring->nextDue)
+		return false;
+	recurring->nextDue += recurring->period;
+	if(recurring->nextDue <= now)
+		recurring->nextDue = now + recurring->period;
+	return true;
+}
 
-	if(numWorkerThreads > 0)
+// stackClass is the configuration's pick for the callback, desc->minStackSize overrides it
+RecurringJob* createRecurringJob(JobDispatcherBase* dispatcher, const RecurringJobDesc* desc, uint8_t stackClass)
+{
+	RecurringJob* recurring = new RecurringJob();
+	if(!recurring)
+		return nullptr;
+	recurring->jobs = new Job[desc->numJobs];
+	if(!recurring->jobs)
 	{
-		g_dispatcher->threads = (Thread**)malloc(sizeof(Thread*)*numWorkerThreads);
+		deleteRecurringJob(recurring);
+		return nullptr;
+	}
 
-		g_dispatcher->numThreads = numWorkerThreads;
-		for(uint8_t i = 0; i < numWorkerThreads; i++)
+	if(desc->minStackSize)
+	{
+		for(uint8_t i = 0; i < dispatcher->numFiberPools; i++)
 		{
-			g_dispatcher->threads[i] = new Thread();
-			g_dispatcher->threads[i]->init(threadFunc, nullptr, 8 * 1024);
+			if(dispatcher->fiberPools[i].isShared())
+				continue;
+			stackClass = i;
+			if(dispatcher->fiberPools[i].getStackSize() >= desc->minStackSize)
+				break;
 		}
 	}
-	return true;
+	stackClass = getJobStackClass(dispatcher, stackClass, desc->job.sharedStack);
+
+	recurring->desc = *desc;
+	recurring->desc.interval = max(desc->interval, 1u);
+	recurring->period = (int64_t)recurring->desc.interval*dispatcher->hpFrequency/1000000;
+	recurring->nextDue = getHPCounter();
+	recurring->tickCount = recurring->desc.interval - 1;    // Both triggers fire on the first tick
+	recurring->runs = 0;
+	recurring->overruns = 0;
+
+	CounterContainer* container = &recurring->container;
+	container->counter = 0;
+	container->waiter = COUNTER_DONE;
+	container->dispatcher = dispatcher;
+	container->shards = nullptr;
+	container->priority = JobPriority::Count;
+	container->lowestQueued = JobPriority::High;
+	container->parent = nullptr;
+
+	for(uint16_t i = 0; i < desc->numJobs; i++)
+	{
+		Job* job = &recurring->jobs[i];
+		job->callback = desc->job.callback;
+		job->userData = desc->job.userParam;
+		job->dispatcher = dispatcher;
+		job->counter = &container->counter;
+		job->shard = nullptr;
+		job->fiber = nullptr;
+		job->claim = nullptr;
+		job->jobIndex = i;
+		job->stackClass = stackClass;
+		job->worker = desc->worker < 0 ? -1 : desc->worker;
+		job->priority = desc->job.priority;
+		job->pinned = desc->job.pinned || (dispatcher->flags & JobDispatcherFlags::PinnedFibers) != 0;
+		job->tiny = desc->job.tiny;
+		job->persistent = true;
+		job->dispatchTime = 0;
+	}
+	return recurring;
 }
 
-void shutdownJobDispatcher()
+RecurringJobHandle addRecurringJob(JobDispatcher* dispatcher, const RecurringJobDesc* desc)
 {
-	if(!g_dispatcher)
+	return addRecurringJob<JobDispatcher>(dispatcher, desc);
+}
+
+void removeRecurringJob(JobDispatcherBase* dispatcher, RecurringJobHandle handle)
+{
+	if(!handle)
 		return;
 
-	// Command all worker threads to stop
-	g_dispatcher->stop = 1;
-	g_dispatcher->semaphore.post(g_dispatcher->numThreads + 1);
-	for(uint8_t i = 0; i < g_dispatcher->numThreads; i++)
+	// No trigger queues it anymore once it's off the list
+	dispatcher->recurringLock.lock();
+	dispatcher->recurringJobs.remove(&handle->lnode);
+	dispatcher->recurringLock.unlock();
+
+	if(handle->container.waiter != COUNTER_DONE)
+		waitCounter(&handle->container);
+	deleteRecurringJob(handle);
+}
+
+uint32_t tickRecurringJobs(JobDispatcher* dispatcher)
+{
+	return tickRecurringJobs<JobDispatcher>(dispatcher);
+}
+
+void deleteRecurringJobs(JobDispatcherBase* dispatcher)
+{
+	while(RecurringJob::LNode* node = dispatcher->recurringJobs.getFirst())
 	{
-		g_dispatcher->threads[i]->shutdown();
-		delete g_dispatcher->threads[i];
+		dispatcher->recurringJobs.remove(node);
+		deleteRecurringJob(node->data);
 	}
-	free(g_dispatcher->threads);
-
-	ThreadData* data = (ThreadData*)g_dispatcher->threadData.get();
-	destroyThreadData(data);
+}
 
-	g_dispatcher->bigFibers.destroy();
-	g_dispatcher->smallFibers.destroy();
-	destroy_fcontext_stack(&g_dispatcher->mainStack);
+void getRecurringJobStats(RecurringJobHandle handle, RecurringJobStats* stats)
+{
+	stats->runs = handle->runs;
+	stats->overruns = handle->overruns;
+}
 
-	g_dispatcher->counterPool.destroy();
+int getJobStackUsage(JobDispatcherBase* dispatcher, JobStackUsage* usage, int maxCount)
+{
+	return dispatcher->stackProfile.getUsage(usage, maxCount);
+}
 
-	delete g_dispatcher;
-	g_dispatcher = nullptr;
+int getJobStackUsage(JobStackUsage* usage, int maxCount)
+{
+	return getJobStackUsage(g_dispatcher, usage, maxCount);
 }
 
-static JobHandle dispatch(const JobDesc* jobs, uint16_t numJobs, FiberPool* pool)
+void printJobStackUsage(JobDispatcherBase* dispatcher)
 {
-	// Get dispatcher counter to assign to jobs
-	ThreadData* data = (ThreadData*)g_dispatcher->threadData.get();
+	JobStackUsage* usage = (JobStackUsage*)malloc(sizeof(JobStackUsage)*MAX_STACK_PROFILE_ENTRIES);
+	if(!usage)
+		return;
+	int count = getJobStackUsage(dispatcher, usage, MAX_STACK_PROFILE_ENTRIES);
 
-	// Get a counter
-	g_dispatcher->counterLock.lock();
-	JobCounter* counter = &g_dispatcher->counterPool.newInstance()->counter;
-	g_dispatcher->counterLock.unlock();
-	if(!counter)
+	// Deepest first
+	for(int i = 1; i < count; i++)
 	{
-		return nullptr;
+		JobStackUsage u = usage[i];
+		int j = i - 1;
+		for(; j >= 0 && usage[j].peakBytes < u.peakBytes; j--)
+			usage[j + 1] = usage[j];
+		usage[j + 1] = u;
 	}
 
-	// Create N Fibers/Job
-	uint32_t count = 0;
-	Fiber** fibers = (Fiber**)alloca(sizeof(Fiber*)*numJobs);
-
-	for(uint16_t i = 0; i < numJobs; i++)
+	printf("%-18s %10s %10s %8s %10s\n", "callback", "peak", "stack", "used%", "jobs");
+	for(int i = 0; i < count; i++)
 	{
-		Fiber* fiber = pool->newFiber(jobs[i].callback, jobs[i].userParam, i, jobs[i].priority, pool, counter);
-		if(fiber)
-		{
-			fibers[i] = fiber;
-			count++;
-		}
+		const JobStackUsage& u = usage[i];
+		printf("%-18p %10u %10u %7.1f%% %10u\n", (void*)u.callback, u.peakBytes, u.stackSize,
+			u.stackSize ? 100.0f*float(u.peakBytes)/float(u.stackSize) : 0.0f, u.numJobs);
+	}
+	for(uint8_t i = 0; i < dispatcher->numFiberPools; i++)
+	{
+		const FiberPool& pool = dispatcher->fiberPools[i];
+		printf("stack class %u: peak %u of %u bytes\n", i, pool.getPeakStackUsage(), pool.getStackSize());
 	}
 
-	*counter = count;
-	if(data->running)
-		data->running->waitCounter = counter;
-
-	g_dispatcher->jobLock.lock();
-	for(uint32_t i = 0; i < count; i++)
-		g_dispatcher->waitList[fibers[i]->priority].addToEnd(&fibers[i]->lnode);
-	g_dispatcher->jobLock.unlock();
-
-	// post to semaphore so worker threads can continue and fetch them
-	g_dispatcher->semaphore.post(count);
-	return counter;
+	free(usage);
 }
 
-JobHandle dispatchSmallJobs(const JobDesc* jobs, uint16_t numJobs)
+void printJobStackUsage()
 {
-	return dispatch(jobs, numJobs, &g_dispatcher->smallFibers);
+	printJobStackUsage(g_dispatcher);
 }
 
-JobHandle dispatchBigJobs(const JobDesc* jobs, uint16_t numJobs)
+static void addWorkerStats(JobDispatcherStats* stats, const ThreadData* data, uint64_t freq, int64_t* suspended)
 {
-	return dispatch(jobs, numJobs, &g_dispatcher->bigFibers);
+	const WorkerCounters& c = data->counters;
+
+	WorkerStats& w = stats->threads[stats->numThreads++];
+	w.busyTime = (uint64_t)c.busyTicks*1000000/freq;
+	w.idleTime = (uint64_t)c.idleTicks*1000000/freq;
+	w.parkedTime = (uint64_t)c.parkedTicks*1000000/freq;
+	w.jobsExecuted = c.jobsExecuted;
+	w.polls = c.polls;
+	w.failedPolls = c.failedPolls;
+
+	stats->polls += c.polls;
+	stats->failedPolls += c.failedPolls;
+	*suspended += (int64_t)(c.fibersSuspended - c.fibersResumed);
+
+	for(int p = 0; p < JobPriority::Count; p++)
+	{
+		for(int b = 0; b < STATS_LATENCY_BUCKETS; b++)
+			stats->priorities[p].latency[b] += c.latency[p][b];
+	}
 }
 
-void waitJobs(JobHandle handle)
+// The creating thread's data is shared between the dispatchers created on it, its counters are too
+// The queue depths are left to the configuration
+void collectJobDispatcherStats(const JobDispatcherBase* dispatcher, JobDispatcherStats* stats)
 {
-	ThreadData* data = (ThreadData*)g_dispatcher->threadData.get();
+	memset(stats, 0x00, sizeof(JobDispatcherStats));
 
-	while(*handle > 0)
+	uint64_t freq = (uint64_t)dispatcher->hpFrequency;
+	int64_t suspended = 0;
+	addWorkerStats(stats, dispatcher->mainThreadData, freq, &suspended);
+	for(uint8_t i = 0; i < dispatcher->numThreads; i++)
 	{
-		// Jump back to worker thread (current job is not finished)
-		fcontext_stack_t* stack = pushWaitStack(data);
-		if(!stack)
-		{
-			return;
-		}
+		// Slots no worker ever ran on are left out
+		if(dispatcher->workerData[i]->threadId != 0)
+			addWorkerStats(stats, dispatcher->workerData[i], freq, &suspended);
+	}
+	stats->waitingFibers = suspended > 0 ? (uint32_t)suspended : 0;
 
-		fcontext_t jobPusherCtx = make_fcontext(stack->sptr, stack->ssize, jobPusherCallback);
+	stats->numFiberPools = dispatcher->numFiberPools;
+	for(uint8_t i = 0; i < dispatcher->numFiberPools; i++)
+	{
+		const FiberPool& pool = dispatcher->fiberPools[i];
+		FiberPoolStats& ps = stats->fiberPools[i];
+		ps.stackSize = pool.getStackSize();
+		ps.maxFibers = pool.getMax();
+		ps.fibersInUse = pool.getNumInUse();
+		ps.peakFibersInUse = pool.getPeakInUse();
+		ps.savedStackBytes = pool.getSavedStackBytes();
+	}
 
-		// This means that user has called 'waitJobs' inside another running task
-		// So the task is WIP, we have to re-add it to the pending jobs so it can continue later on
-		if(data->running)
-		{
-			Fiber* fiber = data->running;
-			data->running = nullptr;
-			fiber->ownerThread = data->threadId;
+	stats->maxCounters = (uint32_t)dispatcher->counterPool.getMaxItems();
+	stats->countersInUse = stats->maxCounters - (uint32_t)dispatcher->counterPool.getNumFree();
+}
 
-			g_dispatcher->jobLock.lock();
-			g_dispatcher->waitList[fiber->priority].addToEnd(&fiber->lnode);
-			g_dispatcher->jobLock.unlock();
+void getJobDispatcherStats(JobDispatcher* dispatcher, JobDispatcherStats* stats)
+{
+	getJobDispatcherStats<JobDispatcher>(dispatcher, stats);
+}
 
-			g_dispatcher->semaphore.post();
-		}
+void getJobDispatcherStats(JobDispatcherStats* stats)
+{
+	getJobDispatcherStats(g_dispatcher, stats);
+}
 
-		// Switch to job-pusher To see if we can process any remaining jobs
-		jump_fcontext(jobPusherCtx, data);
-		popWaitStack(data);
-	}
+bool setWorkerCount(uint8_t count)
+{
+	return setWorkerCount(g_dispatcher, count);
+}
+
+uint8_t getWorkerCount()
+{
+	return getWorkerCount(g_dispatcher);
+}
+
+bool registerExternalThread()
+{
+	return registerExternalThread(g_dispatcher);
+}
 
-	// Delete the counter
-	g_dispatcher->counterLock.lock();
-	g_dispatcher->counterPool.deleteInstance((CounterContainer*)handle);
-	g_dispatcher->counterLock.unlock();
-}
\ No newline at end of file
+RecurringJobHandle addRecurringJob(const RecurringJobDesc* desc)
+{
+	return addRecurringJob(g_dispatcher, desc);
+}
+
+void removeRecurringJob(RecurringJobHandle handle)
+{
+	removeRecurringJob(g_dispatcher, handle);
+}
+
+uint32_t tickRecurringJobs()
+{
+	return tickRecurringJobs(g_dispatcher);
+}
@@ -3,30 +3,64 @@
 #include "Thread.hpp"
 #include "FiberPool.hpp"
 #include "Pool.hpp"
+#include "StackGuard.hpp"
+#include "JobStats.hpp"
+#include "JobPolicies.hpp"
+#include "ResourceTable.hpp"
 
-#define DEFAULT_MAX_SMALL_FIBERS 128
-#define DEFAULT_MAX_BIG_FIBERS 32
-#define DEFAULT_SMALL_STACKSIZE 65536   // 64kb
-#define DEFAULT_BIG_STACKSIZE 524288   // 512kb
+#define DEFAULT_SMALL_STACKSIZE 65536   // 64kb, minimum stack for dispatchSmallJobs
+#define DEFAULT_BIG_STACKSIZE 524288   // 512kb, minimum stack for dispatchBigJobs
+#define JOB_POOL_BUCKET_SIZE 256
+#define MAX_JOB_DISPATCHERS 16
 
-#define MAX_WAIT_STACKS 32
-#define WAIT_STACK_SIZE 8192    // 8kb
+#define WORKER_STACK_SIZE 65536     // 64kb, OS stack of the worker threads, their scheduler loop runs on it
+#define ELASTIC_GROW_SAMPLES 16     // Job picks in a row under pressure before an elastic dispatcher adds a worker
+#define TINY_JOB_BATCH 64           // Tiny jobs a worker pulls in one go
+#define COUNTER_SHARD_MIN_JOBS 32   // Jobs per shard of a sharded counter at least
+#define WORK_FIRST_STACK_ROOM 16384 // Stack a WorkFirstWaits waiter needs left to run its children on it
 
+struct JobDispatcherBase;
+
+struct WorkerState
+{
+	enum Enum
+	{
+		Free = 0,       // Slot never used, or its thread was joined
+		Running,
+		Draining,       // Asked to leave, finishes the fibers pinned to it first
+		Exited,         // Thread is gone or about to, not joined yet
+	};
+};
+
+// One per thread, shared by every dispatcher the thread works for
 struct ThreadData
 {
+	JobDispatcherBase* dispatcher;  // Workers serve only this one, other threads take jobs of whatever they wait on
 	Fiber* running;     // Current running fiber
-	fcontext_stack_t stacks[MAX_WAIT_STACKS];
-	int stackIdx;
+	fcontext_t schedulerContext;    // Where the running fiber goes back to when it finishes or suspends
+	uint32_t refCount;  // Dispatchers created on this thread, non-worker threads only
 	bool main;
+	bool external;      // Joined through registerExternalThread
+	uint8_t workerIndex;
+	volatile int32_t state;     // WorkerState, changed under JobDispatcher::workerLock
 	uint32_t threadId;
+	uint32_t pinnedFibers;      // Suspended here by pinned jobs, only this thread can resume them
+	void* signalStack;  // Alternate stack for the stack overflow handler
+	WorkerCounters counters;    // Kept over the lifetimes of a worker slot
 
 	ThreadData()
 	{
+		dispatcher = nullptr;
 		running = nullptr;
-		stackIdx = 0;
+		schedulerContext = nullptr;
+		refCount = 0;
 		main = false;
+		external = false;
+		workerIndex = 0;
+		state = WorkerState::Free;
 		threadId = 0;
-		memset(stacks, 0x00, sizeof(stacks));
+		pinnedFibers = 0;
+		signalStack = nullptr;
 	}
 };
 
@@ -36,11 +70,40 @@ struct JobDesc
 	JobPriority::Enum priority;
 	void* userParam;
 
+	// A waiting job resumes on whichever worker gets to it first. Pinned ones go back to the
+	// thread they started on, for jobs that keep thread-local state across waits
+	bool pinned;
+
+	// Short callbacks that never block (no waitJobs, parkFiber, appendJobs or channel waits)
+	// A worker pulls a run of them and calls them back to back on a single fiber, with the stack
+	// class of the most demanding one. If no fiber is free the run is called on the worker's own
+	// stack (WORKER_STACK_SIZE), where neither overflows are reported nor stack use is profiled
+	bool tiny;
+
+	// Runs on a shared-stack class if the dispatcher has one (StackClassDesc::shared), for jobs that
+	// spend most of their life suspended. A waiting job's stack is copied away: nothing else may
+	// touch its locals until it resumes, so its children get their data from the heap. The job is
+	// pinned, channel waits take care of themselves
+	bool sharedStack;
+
+	// Resources the job reads or writes, copied at dispatch. Jobs of any dispatch that share one
+	// start in submission order as long as any of them writes it, readers run side by side. Jobs
+	// declaring nothing aren't held. A job must not wait for jobs it conflicts with
+	// A job with more than MAX_JOB_RESOURCES ids, or ids beyond JobDispatcherDesc::maxResources, gets
+	// its whole batch refused: dispatchJobs returns null and appendJobs false, none of it runs
+	const ResourceAccess* resources;
+	uint8_t numResources;
+
 	JobDesc()
 	{
 		callback = nullptr;
 		priority = JobPriority::Normal;
 		userParam = nullptr;
+		pinned = false;
+		tiny = false;
+		sharedStack = false;
+		resources = nullptr;
+		numResources = 0;
 	}
 
 	explicit JobDesc(JobCallback _callback, void* _userParam = nullptr, JobPriority::Enum _priority = JobPriority::Normal)
@@ -48,40 +111,336 @@ struct JobDesc
 		callback = _callback;
 		userParam = _userParam;
 		priority = _priority;
+		pinned = false;
+		tiny = false;
+		sharedStack = false;
+		resources = nullptr;
+		numResources = 0;
+	}
+};
+
+struct RecurringTrigger
+{
+	enum Enum
+	{
+		Tick = 0,   // Every interval-th tickRecurringJobs call
+		Period,     // Every interval microseconds, looked at on tickRecurringJobs calls
+	};
+};
+
+// A job set registered once and dispatched again on every trigger, through addRecurringJob
+struct RecurringJobDesc
+{
+	JobDesc job;                // Callback and priority, pinned keeps them on their thread across waits, no resources
+	uint16_t numJobs;           // Instances per trigger, they get jobIndex 0 to numJobs - 1
+	RecurringTrigger::Enum trigger;
+	uint32_t interval;          // Ticks or microseconds
+	uint32_t minStackSize;      // 0 to pick the stack class from measured use at registration
+
+	// Index of the worker that starts the jobs, -1 for any. The others leave them in the lists
+	// while that worker is running, so the jobs of a run queue up behind each other there
+	int16_t worker;
+
+	RecurringJobDesc()
+	{
+		numJobs = 1;
+		trigger = RecurringTrigger::Tick;
+		interval = 1;
+		minStackSize = 0;
+		worker = -1;
 	}
 };
 
-struct JobDispatcher
+struct RecurringJobStats
+{
+	uint64_t runs;          // Triggers that dispatched the jobs
+	uint64_t overruns;      // Triggers skipped because the previous run was still going
+};
+
+struct RecurringJob;
+typedef RecurringJob* RecurringJobHandle;
+
+struct JobDispatcherFlags
+{
+	enum Enum
+	{
+		StackOverflowHandler = 0x1,     // Report the job that overflowed its fiber stack instead of a bare crash
+		StackProfiling = 0x2,           // Paint fiber stacks and record peak stack depth per callback (commits all stack memory)
+		StackArena = 0x4,               // Carve all fiber stacks from a single mapping, guard pages carved inside it
+		StackArenaHugePages = 0x8,      // Back the arena with huge pages (MAP_HUGETLB or THP), guard pages are dropped
+		StackArenaPrefault = 0x10,      // Workers fault the arena in at startup, in parallel
+		Statistics = 0x20,              // Time busy/idle/parked workers and dispatch latency, see getJobDispatcherStats
+		ElasticWorkers = 0x40,          // Add workers under load up to maxThreads, retire parked ones down to minThreads
+		PinnedFibers = 0x80,            // Every job is pinned (JobDesc::pinned)
+		WorkFirstWaits = 0x100,         // A waiting job runs its queued children on its own fiber first, newest first
+	};
+};
+
+struct StackClassDesc
+{
+	uint32_t stackSize;
+	uint16_t maxFibers;
+
+	// Fibers share one stack of stackSize per worker (and one for the creating thread), and only
+	// the part they use is copied out while they wait, so maxFibers can go far beyond what dedicated
+	// stacks would allow. Only jobs that ask for it run there, see JobDesc::sharedStack. They resume
+	// on the thread they started on like pinned ones, other threads leave them to the workers
+	bool shared;
+};
+
+struct JobDispatcherDesc
 {
+	uint32_t flags;     // JobDispatcherFlags
+
+	// Fiber pools, in ascending stack size. dispatchJobs picks a class per callback from its
+	// measured stack use (needs StackProfiling), and jobs spill to a larger class when theirs is exhausted
+	StackClassDesc stackClasses[MAX_STACK_CLASSES];
+	uint8_t numStackClasses;
+	uint8_t defaultStackClass;      // For callbacks that were never measured, the first dedicated one if it's shared
+
+	int numThreads;                 // Worker threads at start, -1 for one per core minus the creating thread
+	uint8_t minThreads;             // ElasticWorkers never retire below this
+	uint8_t maxThreads;             // Cap for setWorkerCount and elastic growth, at least numThreads
+	ThreadPriority::Enum threadPriority;
+	uint64_t cpuMask;               // CPUs the workers may run on (bit n = CPU n), 0 for any
+
+	// ElasticWorkers: a job pick counts as pressure when more than growQueueDepth jobs per active
+	// worker are left queued, or the job waited more than growLatency microseconds (0 to ignore)
+	uint32_t growQueueDepth;
+	uint32_t growLatency;
+	uint32_t retireTimeout;         // ElasticWorkers: milliseconds parked before a worker retires
+	uint32_t tinyJobBudget;         // Microseconds a run of tiny jobs may take, the rest is queued again (0 for no limit)
+
+	// Dispatches of at least that many jobs count them on a shard per thread, each on its own cache
+	// line, instead of all on the handle's counter (0 to never shard). appendJobs never shards
+	uint32_t shardedBatchSize;
+
+	// Resources JobDesc::resources may hold at once. An id takes one from the dispatch of the first
+	// job that declares it until the last job declaring it finished, a batch that would need more is
+	// refused. 0 refuses every job that declares resources
+	uint32_t maxResources;
+
+	JobDispatcherDesc()
+	{
+		flags = JobDispatcherFlags::StackOverflowHandler;
+		numThreads = -1;
+		minThreads = 0;
+		maxThreads = 0;
+		threadPriority = ThreadPriority::Normal;
+		cpuMask = 0;
+		growQueueDepth = 4;
+		growLatency = 1000;     // 1ms
+		retireTimeout = 5000;   // 5s
+		tinyJobBudget = 50;
+		shardedBatchSize = 1024;
+		maxResources = 1024;
+
+		memset(stackClasses, 0x00, sizeof(stackClasses));
+		stackClasses[0].stackSize = 16384;      // 16kb
+		stackClasses[0].maxFibers = 256;
+		stackClasses[1].stackSize = 65536;      // 64kb
+		stackClasses[1].maxFibers = 128;
+		stackClasses[2].stackSize = 262144;     // 256kb
+		stackClasses[2].maxFibers = 32;
+		stackClasses[3].stackSize = 524288;     // 512kb, dispatchBigJobs
+		stackClasses[3].maxFibers = 32;
+		numStackClasses = 4;
+		defaultStackClass = 1;
+	}
+};
+
+// Entry points of a dispatcher's configuration for code that only has a handle or a job, not the
+// dispatcher's type: waits, wakeups across dispatchers and appendJobs
+struct JobDispatcherHooks
+{
+	void (*pushReadyJob)(Job* job);
+	uint32_t (*queueJobs)(JobDispatcherBase* dispatcher, JobCounter* counter, const JobDesc* jobs, uint16_t numJobs, int stackClass);
+	bool (*runNextJob)(JobDispatcherBase* dispatcher, ThreadData* data, bool* listNotEmpty);
+	bool (*runChildJob)(JobDispatcherBase* dispatcher, Fiber* fiber, CounterContainer* container);
+	bool (*raiseCounter)(CounterContainer* container, JobPriority::Enum priority);
+};
+
+// The part every configuration shares
+struct JobDispatcherBase
+{
+	const JobDispatcherHooks* hooks;
+	uint32_t flags;
 	Thread** threads;
-	uint8_t numThreads;
-	FiberPool smallFibers;
-	FiberPool bigFibers;
+	uint8_t numThreads;         // Worker slots, threads and workerData have that many entries
+	uint8_t numInitialThreads;
+	uint8_t minThreads;
+	volatile int32_t numActiveThreads;  // Running workers, not counting draining ones
+	volatile int32_t pressure;          // ElasticWorkers, job picks under pressure in a row
+	uint32_t growQueueDepth;
+	uint32_t growLatency;
+	uint32_t retireTimeout;
+	int64_t tinyJobBudget;      // In getHPCounter ticks
+	uint32_t shardedBatchSize;
+	volatile int32_t pendingLists;              // Bit per job list with jobs queued, read without jobLock
+	uint8_t priorityList[JobPriority::Count];   // QueuePolicy::getList of each priority
+	Lock workerLock;
+	FiberPool fiberPools[MAX_STACK_CLASSES];    // One per stack class, ascending stack size
+	uint8_t numFiberPools;
+	uint8_t defaultStackClass;
+	uint8_t smallStackClass;    // First classes that fit DEFAULT_SMALL_STACKSIZE/DEFAULT_BIG_STACKSIZE
+	uint8_t bigStackClass;
 
-	List<Fiber*> waitList[JobPriority::Count];  // 3 lists for each priority
-	Lock jobLock;
+	Job::LNode* volatile inbox;     // Jobs from threads the dispatcher doesn't know, newest first, drained into the job lists
 	Lock counterLock;
-	TlsData threadData;
 	volatile int32_t stop;
+	ThreadData* mainThreadData;     // Creating thread, possibly shared with other dispatchers
+	ThreadData** workerData;
+	int64_t hpFrequency;
+	ThreadPriority::Enum threadPriority;
+	uint64_t cpuMask;
 
-	fcontext_stack_t mainStack;
-	FixedPool<CounterContainer> counterPool;
-	JobCounter dummyCounter;
+	List<RecurringJob*> recurringJobs;
+	Lock recurringLock;     // Taken before jobLock
 
-	Semaphore semaphore;
+	fcontext_arena_t stackArena;
+	Pool<CounterContainer> counterPool;     // Grows, a waiting job running its children inline nests waits past the fiber count
+	ConcurrentPool<Job> jobPool;
+	ResourceTable resources;    // Queues of the resources jobs declared, see JobDesc::resources
+	StackProfile stackProfile;
 
-	JobDispatcher()
+	JobDispatcherBase()
 	{
+		hooks = nullptr;
+		flags = 0;
 		threads = nullptr;
 		numThreads = 0;
+		numInitialThreads = 0;
+		minThreads = 0;
+		numActiveThreads = 0;
+		pressure = 0;
+		growQueueDepth = 0;
+		growLatency = 0;
+		retireTimeout = 0;
+		tinyJobBudget = 0;
+		shardedBatchSize = 0;
+		pendingLists = 0;
+		memset(priorityList, 0x00, sizeof(priorityList));
+		numFiberPools = 0;
+		defaultStackClass = 0;
+		smallStackClass = 0;
+		bigStackClass = 0;
 		stop = 0;
-		dummyCounter = 0;
-		memset(&mainStack, 0x00, sizeof(mainStack));
+		mainThreadData = nullptr;
+		workerData = nullptr;
+		hpFrequency = 0;
+		threadPriority = ThreadPriority::Normal;
+		cpuMask = 0;
+		inbox = nullptr;
+		memset(&stackArena, 0x00, sizeof(stackArena));
 	}
 };
 
-bool initJobDispatcher();
+// A dispatcher with its job lists, locks, wakeups, stack selection and instrumentation picked at
+// compile time, see JobPolicies.hpp. The implementation is in BasicJobDispatcher.hpp
+template <typename Queue, typename LockTy, typename Wait, typename Stack, typename Trace>
+struct BasicJobDispatcher : JobDispatcherBase
+{
+	typedef Queue QueuePolicy;
+	typedef LockTy LockPolicy;
+	typedef Wait WaitPolicy;
+	typedef Stack StackPolicy;
+	typedef Trace TracePolicy;
+
+	List<Job*> waitList[QueuePolicy::NumLists];
+	uint32_t queueDepth[QueuePolicy::NumLists];    // Jobs in each list, updated under jobLock
+	LockPolicy jobLock;
+	WaitPolicy semaphore;
+
+	BasicJobDispatcher()
+	{
+		memset(queueDepth, 0x00, sizeof(queueDepth));
+	}
+};
+
+// The default configuration, the API below is the one for it
+typedef BasicJobDispatcher<PriorityQueuePolicy, Lock, Semaphore, ProfiledStackPolicy, StatsTracePolicy> JobDispatcher;
+
+// Dispatchers are independent groups of workers with their own queues and fibers. Jobs of one
+// may wait on jobs of another, the waiting fiber is resumed by its own group
+// Other configurations have the same calls as templates in BasicJobDispatcher.hpp
+JobDispatcher* createJobDispatcher(const JobDispatcherDesc* desc = nullptr);
+void destroyJobDispatcher(JobDispatcher* dispatcher);
+
+// Starts or drains workers until count are running, count is capped at maxThreads
+// Draining workers first finish the pinned fibers suspended on them, the call returns once they are joined
+// Must not be called from a job of the same dispatcher
+bool setWorkerCount(JobDispatcher* dispatcher, uint8_t count);
+uint8_t getWorkerCount(const JobDispatcherBase* dispatcher);
+
+// Stack class is picked per callback from measured stack use. Null if no job could be created,
+// or the batch was refused over its resources, see JobDesc::resources
+JobHandle dispatchJobs(JobDispatcher* dispatcher, const JobDesc* jobs, uint16_t numJobs);
+// Explicit minimum stack size, DEFAULT_SMALL_STACKSIZE and DEFAULT_BIG_STACKSIZE
+JobHandle dispatchSmallJobs(JobDispatcher* dispatcher, const JobDesc* jobs, uint16_t numJobs);
+JobHandle dispatchBigJobs(JobDispatcher* dispatcher, const JobDesc* jobs, uint16_t numJobs);
+// Works with the handle of any dispatcher. A job waiting on the handle lends its priority to the
+// handle's jobs, and through their own waits to everything below, until the handle is released
+void waitJobs(JobHandle handle);
+// Adds jobs to the handle of the calling job, whoever waits on it waits for them too
+// Only from inside a job, returns false outside of one or if not every job could be created
+bool appendJobs(const JobDesc* jobs, uint16_t numJobs);
+
+// Building blocks for primitives that block a job on something else than a JobHandle
+// parkFiber suspends the running job, onPark runs once its fiber is off its stack and must hand
+// the fiber to whoever calls unparkFiber later. Only from inside a job
+typedef void (*FiberParkCallback)(Fiber* fiber, void* userParam);
+Fiber* getRunningFiber();   // Null outside of a job
+void parkFiber(FiberParkCallback onPark, void* userParam);
+void unparkFiber(Fiber* fiber);
+// Requeues the running job behind the jobs of its priority and lets the thread run whatever is
+// most urgent first. False outside of a job or in a tiny one, where it does nothing
+bool yieldJob();
+// Yields only if a job of a higher priority than the running one is queued, a single atomic
+// load otherwise. For long jobs to call at safe points
+bool yieldIfHigherPriorityPending();
+// Plain threads run a ready job of their dispatcher while they wait, false if there was none
+bool runPendingJob();
+// Whether runPendingJob may run anything here, false inside a job and on threads no dispatcher knows
+bool canRunPendingJobs();
+
+// Any thread may dispatch and wait. On threads the job system doesn't know the jobs go through
+// a lock-free inbox instead of the job lists, and waitJobs sleeps until the jobs are done
+// Registering lets the thread run the dispatcher's jobs while it waits instead. It has to
+// unregister before it exits, and no pinned job it ran may be suspended on it by then
+// Returns false if the thread is known already, a worker or one that created a dispatcher
+bool registerExternalThread(JobDispatcherBase* dispatcher);
+void unregisterExternalThread();
+
+// Recurring jobs keep their job records and counter between runs, a trigger only queues them again
+// A trigger that comes while the previous run isn't finished is skipped and counted as an overrun
+// Nobody may wait on the jobs of a registration, appendJobs from them works as usual
+RecurringJobHandle addRecurringJob(JobDispatcher* dispatcher, const RecurringJobDesc* desc);
+// Waits for the running instances like waitJobs, then frees the registration
+void removeRecurringJob(JobDispatcherBase* dispatcher, RecurringJobHandle handle);
+// Queues every registration that is due, from any thread once per frame or so
+// Returns the number of overruns of this tick
+uint32_t tickRecurringJobs(JobDispatcher* dispatcher);
+void getRecurringJobStats(RecurringJobHandle handle, RecurringJobStats* stats);
+
+// Peak stack depth per callback, needs JobDispatcherFlags::StackProfiling
+int getJobStackUsage(JobDispatcherBase* dispatcher, JobStackUsage* usage, int maxCount);
+void printJobStackUsage(JobDispatcherBase* dispatcher);
+
+// Sums up the per thread counters, cheap enough to call every frame
+void getJobDispatcherStats(JobDispatcher* dispatcher, JobDispatcherStats* stats);
+
+// Same on the default dispatcher, the one initJobDispatcher creates
+bool initJobDispatcher(const JobDispatcherDesc* desc = nullptr);
 void shutdownJobDispatcher();
+JobHandle dispatchJobs(const JobDesc* jobs, uint16_t numJobs);
 JobHandle dispatchSmallJobs(const JobDesc* jobs, uint16_t numJobs);
 JobHandle dispatchBigJobs(const JobDesc* jobs, uint16_t numJobs);
-void waitJobs(JobHandle handle);
\ No newline at end of file
+int getJobStackUsage(JobStackUsage* usage, int maxCount);
+void printJobStackUsage();
+void getJobDispatcherStats(JobDispatcherStats* stats);
+bool setWorkerCount(uint8_t count);
+uint8_t getWorkerCount();
+bool registerExternalThread();
+RecurringJobHandle addRecurringJob(const RecurringJobDesc* desc);
+void removeRecurringJob(RecurringJobHandle handle);
+uint32_t tickRecurringJobs();
@@ -0,0 +1,221 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "Fiber.hpp"
+#include "FiberPool.hpp"
+#include "JobStats.hpp"
+#include "Lock.hpp"
+#include "Thread.hpp"
+
+// Compile-time choices of BasicJobDispatcher. The lock and wait policies are the types themselves,
+// anything with lock/unlock and post/wait like Lock and Semaphore fits. The others are called
+// statically, a disabled one is a set of empty inline functions
+
+// One job list per priority, workers take the most urgent job first
+struct PriorityQueuePolicy
+{
+	static const int NumLists = JobPriority::Count;
+
+	static int getList(JobPriority::Enum _priority)
+	{
+		return _priority;
+	}
+
+	static JobPriority::Enum getListPriority(int _list)
+	{
+		return (JobPriority::Enum)_list;
+	}
+};
+
+// A single list, jobs run in the order they were queued whatever their priority
+struct FifoQueuePolicy
+{
+	static const int NumLists = 1;
+
+	static int getList(JobPriority::Enum _priority)
+	{
+		return 0;
+	}
+
+	static JobPriority::Enum getListPriority(int _list)
+	{
+		return JobPriority::Normal;
+	}
+};
+
+// Workers never sleep, they yield while there's nothing to do. Lowest wakeup latency, burns the cores
+class SpinSemaphore
+{
+public:
+	SpinSemaphore()
+	{
+		m_count = 0;
+	}
+
+	void post(uint32_t _count = 1)
+	{
+		atomicFetchAndAdd(&m_count, (int32_t)_count);
+	}
+
+	bool wait(int32_t _msecs = -1)
+	{
+		int64_t deadline = _msecs < 0 ? 0 : getHPCounter() + (int64_t)_msecs*getHPFrequency()/1000;
+		for(;;)
+		{
+			int32_t count = atomicLoadAcquire(&m_count);
+			if(count > 0)
+			{
+				if(atomicCompareAndSwap(&m_count, count, count - 1) == count)
+					return true;
+				continue;
+			}
+			if(_msecs >= 0 && getHPCounter() >= deadline)
+				return false;
+			Thread::yield();
+		}
+	}
+
+private:
+	volatile int32_t m_count;
+};
+
+// Stack classes are picked per callback from measured use, JobDispatcherFlags::StackProfiling
+// paints the stacks and measures them when a fiber is released
+struct ProfiledStackPolicy
+{
+	static bool paintStacks(bool _profiling)
+	{
+		return _profiling;
+	}
+
+	// Smallest class that fits the callback's measured stack use with some headroom
+	template <typename Dispatcher>
+	static uint8_t getStackClass(const Dispatcher* _dispatcher, JobCallback _callback)
+	{
+		uint32_t peak = _dispatcher->stackProfile.getPeak(_callback);
+		if(peak == 0)
+			return _dispatcher->defaultStackClass;
+
+		// Shared-stack classes are only for the jobs that ask for them
+		uint32_t required = peak + peak / 4;
+		uint8_t largest = _dispatcher->defaultStackClass;
+		for(uint8_t i = 0; i < _dispatcher->numFiberPools; i++)
+		{
+			if(_dispatcher->fiberPools[i].isShared())
+				continue;
+			if(_dispatcher->fiberPools[i].getStackSize() >= required)
+				return i;
+			largest = i;
+		}
+		return largest;
+	}
+
+	template <typename Dispatcher>
+	static void recordStack(Dispatcher* _dispatcher, JobCallback _callback, FiberPool* _pool, Fiber* _fiber)
+	{
+		if(_pool->isPainted())
+			_dispatcher->stackProfile.record(_callback, _pool->measureStack(_fiber), _pool->getStackSize());
+	}
+};
+
+// Every job gets the default stack class or the one asked for, nothing is painted or measured
+struct FixedStackPolicy
+{
+	static bool paintStacks(bool _profiling)
+	{
+		return false;
+	}
+
+	template <typename Dispatcher>
+	static uint8_t getStackClass(const Dispatcher* _dispatcher, JobCallback _callback)
+	{
+		return _dispatcher->defaultStackClass;
+	}
+
+	template <typename Dispatcher>
+	static void recordStack(Dispatcher* _dispatcher, JobCallback _callback, FiberPool* _pool, Fiber* _fiber)
+	{
+	}
+};
+
+// Per worker counters, JobDispatcherFlags::Statistics adds the timings and dispatch latencies
+struct StatsTracePolicy
+{
+	static bool isTimed(bool _statistics)
+	{
+		return _statistics;
+	}
+
+	static void poll(WorkerCounters& _counters, bool _found)
+	{
+		_counters.polls++;
+		if(!_found)
+			_counters.failedPolls++;
+	}
+
+	static void jobsExecuted(WorkerCounters& _counters, uint32_t _count)
+	{
+		_counters.jobsExecuted += _count;
+	}
+
+	// Microseconds from dispatch to start
+	static void latency(WorkerCounters& _counters, JobPriority::Enum _priority, uint64_t _usecs)
+	{
+		uint32_t bucket = 0;
+		while(_usecs > 1 && bucket < STATS_LATENCY_BUCKETS - 1)
+		{
+			_usecs >>= 1;
+			bucket++;
+		}
+		_counters.latency[_priority][bucket]++;
+	}
+
+	static void busy(WorkerCounters& _counters, int64_t _ticks)
+	{
+		_counters.busyTicks += _ticks;
+	}
+
+	static void idle(WorkerCounters& _counters, int64_t _ticks)
+	{
+		_counters.idleTicks += _ticks;
+	}
+
+	static void parked(WorkerCounters& _counters, int64_t _ticks)
+	{
+		_counters.parkedTicks += _ticks;
+	}
+};
+
+// No counters and no timings, JobDispatcherFlags::Statistics is ignored
+struct NoTracePolicy
+{
+	static bool isTimed(bool _statistics)
+	{
+		return false;
+	}
+
+	static void poll(WorkerCounters& _counters, bool _found)
+	{
+	}
+
+	static void jobsExecuted(WorkerCounters& _counters, uint32_t _count)
+	{
+	}
+
+	static void latency(WorkerCounters& _counters, JobPriority::Enum _priority, uint64_t _usecs)
+	{
+	}
+
+	static void busy(WorkerCounters& _counters, int64_t _ticks)
+	{
+	}
+
+	static void idle(WorkerCounters& _counters, int64_t _ticks)
+	{
+	}
+
+	static void parked(WorkerCounters& _counters, int64_t _ticks)
+	{
+	}
+};
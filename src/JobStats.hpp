@@ -0,0 +1,69 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+#include "FiberPool.hpp"
+
+#define MAX_STATS_THREADS 256           // Main thread plus every worker
+#define STATS_LATENCY_BUCKETS 24        // Bucket i counts latencies in [2^i, 2^(i+1)) microseconds, bucket 0 also < 1us
+
+// Raw counters of one thread, only written by that thread
+// Readers see them without any synchronization, a snapshot can be off by the jobs in flight
+struct WorkerCounters
+{
+	volatile int64_t busyTicks;         // Running jobs
+	volatile int64_t idleTicks;         // Scanning the job lists, or spinning in waitJobs on the main thread
+	volatile int64_t parkedTicks;       // Asleep on the dispatcher semaphore
+	volatile uint64_t jobsExecuted;
+	volatile uint64_t polls;            // Job list scans
+	volatile uint64_t failedPolls;      // Scans that found nothing this thread could run
+	volatile uint64_t fibersSuspended;  // waitJobs calls that parked a fiber
+	volatile uint64_t fibersResumed;
+	volatile uint32_t latency[JobPriority::Count][STATS_LATENCY_BUCKETS];   // Dispatch to start
+
+	WorkerCounters()
+	{
+		memset((void*)this, 0x00, sizeof(*this));
+	}
+};
+
+// Times are in microseconds, they are only collected with JobDispatcherFlags::Statistics
+struct WorkerStats
+{
+	uint64_t busyTime;
+	uint64_t idleTime;
+	uint64_t parkedTime;
+	uint64_t jobsExecuted;
+	uint64_t polls;
+	uint64_t failedPolls;
+};
+
+struct PriorityStats
+{
+	uint32_t queueDepth;    // Jobs in the list, not started and resumable ones
+	uint64_t latency[STATS_LATENCY_BUCKETS];
+};
+
+struct FiberPoolStats
+{
+	uint32_t stackSize;
+	uint32_t maxFibers;
+	uint32_t fibersInUse;
+	uint32_t peakFibersInUse;
+	uint32_t savedStackBytes;   // Shared-stack classes, heap memory holding the stacks of their fibers
+};
+
+struct JobDispatcherStats
+{
+	WorkerStats threads[MAX_STATS_THREADS];     // Main thread first
+	uint32_t numThreads;
+	PriorityStats priorities[JobPriority::Count];
+	FiberPoolStats fiberPools[MAX_STACK_CLASSES];
+	uint32_t numFiberPools;
+	uint32_t waitingFibers;     // Fibers suspended in waitJobs
+	uint32_t countersInUse;
+	uint32_t maxCounters;
+	uint64_t polls;
+	uint64_t failedPolls;
+};
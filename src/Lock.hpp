@@ -41,6 +41,34 @@ inline int64_t atomicCompareAndSwap(volatile int64_t* _ptr, int64_t _old, int64_
 #endif
 }
 
+inline int32_t atomicCompareAndSwap(volatile int32_t* _ptr, int32_t _old, int32_t _new)
+{
+#ifdef WALO_COMPILER_MSVC
+	return _InterlockedCompareExchange((volatile long*)(_ptr), _new, _old);
+#else
+	return __sync_val_compare_and_swap((volatile int32_t*)_ptr, _old, _new);
+#endif
+}
+
+inline void* atomicCompareAndSwapPtr(void* volatile* _ptr, void* _old, void* _new)
+{
+#ifdef WALO_COMPILER_MSVC
+	return _InterlockedCompareExchangePointer(_ptr, _new, _old);
+#else
+	return __sync_val_compare_and_swap(_ptr, _old, _new);
+#endif
+}
+
+inline void* atomicExchangePtr(void* volatile* _ptr, void* _new)
+{
+#ifdef WALO_COMPILER_MSVC
+	return _InterlockedExchangePointer(_ptr, _new);
+#else
+	__sync_synchronize();    // test_and_set alone is only an acquire barrier
+	return __sync_lock_test_and_set(_ptr, _new);
+#endif
+}
+
 inline int32_t atomicFetchAndSub(volatile int32_t* _ptr, int32_t _sub)
 {
 #ifdef WALO_COMPILER_MSVC
@@ -50,6 +78,79 @@ inline int32_t atomicFetchAndSub(volatile int32_t* _ptr, int32_t _sub)
 #endif // BX_COMPILER_
 }
 
+inline void atomicMax(volatile int32_t* _ptr, int32_t _value)
+{
+	int32_t old = *_ptr;
+	while(old < _value)
+	{
+		int32_t prev = atomicCompareAndSwap(_ptr, old, _value);
+		if(prev == old)
+			break;
+		old = prev;
+	}
+}
+
+inline int32_t atomicLoadAcquire(const volatile int32_t* _ptr)
+{
+#ifdef WALO_COMPILER_MSVC
+	int32_t value = *_ptr;
+	_ReadWriteBarrier();
+	return value;
+#else
+	return __atomic_load_n(_ptr, __ATOMIC_ACQUIRE);
+#endif
+}
+
+inline void atomicStoreRelease(volatile int32_t* _ptr, int32_t _value)
+{
+#ifdef WALO_COMPILER_MSVC
+	_ReadWriteBarrier();
+	*_ptr = _value;
+#else
+	__atomic_store_n(_ptr, _value, __ATOMIC_RELEASE);
+#endif
+}
+
+inline void* atomicLoadAcquirePtr(void* const volatile* _ptr)
+{
+#ifdef WALO_COMPILER_MSVC
+	void* value = *_ptr;
+	_ReadWriteBarrier();
+	return value;
+#else
+	return __atomic_load_n(_ptr, __ATOMIC_ACQUIRE);
+#endif
+}
+
+inline void atomicStoreReleasePtr(void* volatile* _ptr, void* _value)
+{
+#ifdef WALO_COMPILER_MSVC
+	_ReadWriteBarrier();
+	*_ptr = _value;
+#else
+	__atomic_store_n(_ptr, _value, __ATOMIC_RELEASE);
+#endif
+}
+
+inline int32_t atomicFetchAndOr(volatile int32_t* _ptr, int32_t _bits)
+{
+#ifdef WALO_COMPILER_MSVC
+	return _InterlockedOr((volatile long*)_ptr, _bits);
+#else
+	return __sync_fetch_and_or(_ptr, _bits);
+#endif
+}
+
+// Full barrier, a store before it is visible to other threads before any load after it
+inline void atomicFence()
+{
+#ifdef WALO_COMPILER_MSVC
+	MemoryBarrier();
+#else
+	__sync_synchronize();
+#endif
+}
+
 inline void readWriteBarrier()
 {
 #ifdef WALO_COMPILER_MSVC
@@ -129,6 +230,38 @@ private:
 	Data m_data;
 };
 
+// Test-and-set lock, cheaper than the ticket lock when it's rarely contended but not fair
+class SpinLock
+{
+public:
+	SpinLock()
+	{
+		m_locked = 0;
+	}
+
+	void lock()
+	{
+		while(atomicCompareAndSwap(&m_locked, 0, 1) != 0)
+		{
+			while(m_locked)
+				Thread::yield();
+		}
+	}
+
+	void unlock()
+	{
+		atomicStoreRelease(&m_locked, 0);
+	}
+
+	bool tryLock()
+	{
+		return atomicCompareAndSwap(&m_locked, 0, 1) == 0;
+	}
+
+private:
+	volatile int32_t m_locked;
+};
+
 class LockScope
 {
 public:
@@ -0,0 +1,552 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <new>
+#include <algorithm>
+
+#include "JobDispatcher.hpp"
+
+#define PARALLEL_MAX_CHUNKS 256         // Jobs per pass at most
+#define PARALLEL_CHUNKS_PER_WORKER 4    // Slack so uneven chunks even out
+#define PARALLEL_MIN_GRAIN 16384        // Elements per chunk at least, smaller inputs run on the calling thread
+#define RADIX_BITS 8
+#define RADIX_BUCKETS (1 << RADIX_BITS)
+
+// Parallel algorithms on the job system. Each pass fans out one job per chunk and waits with waitJobs,
+// so called from a job it suspends the fiber, called from a plain thread it runs the jobs too
+// A null dispatcher means the default one. The calls without one use the default dispatcher as well
+// When no counter or job can be had the pass runs on the calling thread instead
+
+// Splits count elements into numChunks ranges of chunkSize, the last one may be shorter
+struct ParallelChunks
+{
+	size_t count;
+	size_t chunkSize;
+	uint32_t numChunks;
+
+	void getRange(uint32_t chunk, size_t* begin, size_t* end) const
+	{
+		*begin = chunk*chunkSize;
+		*end = (count - *begin > chunkSize) ? *begin + chunkSize : count;
+	}
+};
+
+// A few chunks per worker plus the calling thread, at least grain elements each
+inline ParallelChunks makeParallelChunks(JobDispatcher* dispatcher, size_t count, size_t grain)
+{
+	size_t numThreads = (size_t)(dispatcher ? getWorkerCount(dispatcher) : getWorkerCount()) + 1;
+	size_t maxChunks = numThreads*PARALLEL_CHUNKS_PER_WORKER;
+	if(maxChunks > PARALLEL_MAX_CHUNKS)
+		maxChunks = PARALLEL_MAX_CHUNKS;
+
+	size_t numChunks = grain ? count/grain : count;
+	if(numChunks > maxChunks)
+		numChunks = maxChunks;
+	if(numChunks == 0)
+		numChunks = 1;
+
+	ParallelChunks chunks;
+	chunks.count = count;
+	chunks.chunkSize = (count + numChunks - 1)/numChunks;
+	chunks.numChunks = chunks.chunkSize ? (uint32_t)((count + chunks.chunkSize - 1)/chunks.chunkSize) : 0;
+	return chunks;
+}
+
+template <typename Fn>
+struct ParallelForJob
+{
+	const Fn* fn;
+	const ParallelChunks* chunks;
+
+	static void run(int jobIndex, void* userData)
+	{
+		const ParallelForJob* job = (const ParallelForJob*)userData;
+		size_t begin, end;
+		job->chunks->getRange((uint32_t)jobIndex, &begin, &end);
+		(*job->fn)((uint32_t)jobIndex, begin, end);
+	}
+};
+
+// Calls fn(chunk, begin, end) for every chunk, one job each, and waits for all of them
+template <typename Fn>
+void parallelForChunks(JobDispatcher* dispatcher, const ParallelChunks& chunks, const Fn& fn)
+{
+	if(chunks.numChunks <= 1)
+	{
+		if(chunks.numChunks == 1)
+			fn(0, 0, chunks.count);
+		return;
+	}
+
+	ParallelForJob<Fn> job;
+	job.fn = &fn;
+	job.chunks = &chunks;
+
+	JobDesc jobs[PARALLEL_MAX_CHUNKS];
+	for(uint32_t i = 0; i < chunks.numChunks; i++)
+		jobs[i] = JobDesc(ParallelForJob<Fn>::run, &job);
+
+	uint16_t numJobs = (uint16_t)chunks.numChunks;
+	JobHandle handle = dispatcher ? dispatchJobs(dispatcher, jobs, numJobs) : dispatchJobs(jobs, numJobs);
+	if(!handle)
+	{
+		for(uint32_t i = 0; i < chunks.numChunks; i++)
+			ParallelForJob<Fn>::run((int)i, &job);
+		return;
+	}
+	waitJobs(handle);
+}
+
+// Scratch array freed with the scope, data is null if the allocation failed
+template <typename Ty>
+struct ParallelBuffer
+{
+	Ty* data;
+
+	explicit ParallelBuffer(size_t count)
+	{
+		data = new(std::nothrow) Ty[count ? count : 1];
+	}
+
+	~ParallelBuffer()
+	{
+		delete[] data;
+	}
+
+private:
+	ParallelBuffer(const ParallelBuffer&);
+	ParallelBuffer& operator=(const ParallelBuffer&);
+};
+
+// Sum of the elements with an associative op, partials are combined in chunk order so op needn't be commutative
+template <typename Ty, typename Op>
+Ty parallelReduce(JobDispatcher* dispatcher, const Ty* data, size_t count, Ty init, Op op, size_t grain = PARALLEL_MIN_GRAIN)
+{
+	ParallelChunks chunks = makeParallelChunks(dispatcher, count, grain);
+	ParallelBuffer<Ty> partials(chunks.numChunks);
+	if(chunks.numChunks <= 1 || !partials.data)
+	{
+		for(size_t i = 0; i < count; i++)
+			init = op(init, data[i]);
+		return init;
+	}
+
+	// Every chunk folds from its own first element, no identity value needed
+	parallelForChunks(dispatcher, chunks, [&](uint32_t chunk, size_t begin, size_t end)
+	{
+		Ty sum = data[begin];
+		for(size_t i = begin + 1; i < end; i++)
+			sum = op(sum, data[i]);
+		partials.data[chunk] = sum;
+	});
+
+	for(uint32_t i = 0; i < chunks.numChunks; i++)
+		init = op(init, partials.data[i]);
+	return init;
+}
+
+// Two passes over blocks: block sums, a serial scan of them, then every block scans from its offset
+// in and out may be the same array
+template <typename Ty, typename Op>
+void parallelInclusiveScan(JobDispatcher* dispatcher, const Ty* in, Ty* out, size_t count, Op op, size_t grain = PARALLEL_MIN_GRAIN)
+{
+	ParallelChunks chunks = makeParallelChunks(dispatcher, count, grain);
+	ParallelBuffer<Ty> offsets(chunks.numChunks);
+	if(chunks.numChunks <= 1 || !offsets.data)
+	{
+		if(count == 0)
+			return;
+		Ty sum = in[0];
+		out[0] = sum;
+		for(size_t i = 1; i < count; i++)
+		{
+			sum = op(sum, in[i]);
+			out[i] = sum;
+		}
+		return;
+	}
+
+	// Block sums, the last block's isn't needed
+	ParallelChunks sumChunks = chunks;
+	sumChunks.count = chunks.chunkSize*(chunks.numChunks - 1);
+	sumChunks.numChunks = chunks.numChunks - 1;
+	parallelForChunks(dispatcher, sumChunks, [&](uint32_t chunk, size_t begin, size_t end)
+	{
+		Ty sum = in[begin];
+		for(size_t i = begin + 1; i < end; i++)
+			sum = op(sum, in[i]);
+		offsets.data[chunk + 1] = sum;
+	});
+
+	// offsets[0] stays unused, block 0 has nothing before it
+	for(uint32_t i = 2; i < chunks.numChunks; i++)
+		offsets.data[i] = op(offsets.data[i - 1], offsets.data[i]);
+
+	parallelForChunks(dispatcher, chunks, [&](uint32_t chunk, size_t begin, size_t end)
+	{
+		Ty sum = chunk ? op(offsets.data[chunk], in[begin]) : in[begin];
+		out[begin] = sum;
+		for(size_t i = begin + 1; i < end; i++)
+		{
+			sum = op(sum, in[i]);
+			out[i] = sum;
+		}
+	});
+}
+
+// out[i] is init combined with every element before i, in and out may be the same array
+template <typename Ty, typename Op>
+void parallelExclusiveScan(JobDispatcher* dispatcher, const Ty* in, Ty* out, size_t count, Ty init, Op op, size_t grain = PARALLEL_MIN_GRAIN)
+{
+	ParallelChunks chunks = makeParallelChunks(dispatcher, count, grain);
+	ParallelBuffer<Ty> offsets(chunks.numChunks);
+	if(chunks.numChunks <= 1 || !offsets.data)
+	{
+		for(size_t i = 0; i < count; i++)
+		{
+			Ty value = in[i];
+			out[i] = init;
+			init = op(init, value);
+		}
+		return;
+	}
+
+	ParallelChunks sumChunks = chunks;
+	sumChunks.count = chunks.chunkSize*(chunks.numChunks - 1);
+	sumChunks.numChunks = chunks.numChunks - 1;
+	parallelForChunks(dispatcher, sumChunks, [&](uint32_t chunk, size_t begin, size_t end)
+	{
+		Ty sum = in[begin];
+		for(size_t i = begin + 1; i < end; i++)
+			sum = op(sum, in[i]);
+		offsets.data[chunk + 1] = sum;
+	});
+
+	offsets.data[0] = init;
+	for(uint32_t i = 1; i < chunks.numChunks; i++)
+		offsets.data[i] = op(offsets.data[i - 1], offsets.data[i]);
+
+	parallelForChunks(dispatcher, chunks, [&](uint32_t chunk, size_t begin, size_t end)
+	{
+		Ty sum = offsets.data[chunk];
+		for(size_t i = begin; i < end; i++)
+		{
+			Ty value = in[i];
+			out[i] = sum;
+			sum = op(sum, value);
+		}
+	});
+}
+
+// Maps a key to unsigned bits with the same order, negative floats included
+template <typename Ty>
+struct RadixKey;
+
+template <>
+struct RadixKey<uint32_t>
+{
+	typedef uint32_t Bits;
+	static Bits toBits(uint32_t key) { return key; }
+};
+
+template <>
+struct RadixKey<int32_t>
+{
+	typedef uint32_t Bits;
+	static Bits toBits(int32_t key) { return (uint32_t)key ^ 0x80000000u; }
+};
+
+template <>
+struct RadixKey<float>
+{
+	typedef uint32_t Bits;
+	static Bits toBits(float key)
+	{
+		uint32_t bits;
+		memcpy(&bits, &key, sizeof(bits));
+		return (bits & 0x80000000u) ? ~bits : (bits | 0x80000000u);
+	}
+};
+
+template <>
+struct RadixKey<uint64_t>
+{
+	typedef uint64_t Bits;
+	static Bits toBits(uint64_t key) { return key; }
+};
+
+template <>
+struct RadixKey<int64_t>
+{
+	typedef uint64_t Bits;
+	static Bits toBits(int64_t key) { return (uint64_t)key ^ 0x8000000000000000ull; }
+};
+
+template <>
+struct RadixKey<double>
+{
+	typedef uint64_t Bits;
+	static Bits toBits(double key)
+	{
+		uint64_t bits;
+		memcpy(&bits, &key, sizeof(bits));
+		return (bits & 0x8000000000000000ull) ? ~bits : (bits | 0x8000000000000000ull);
+	}
+};
+
+// LSD radix sort, RADIX_BITS per pass. Each pass counts digits per chunk, turns the counts into
+// per chunk write offsets and scatters, so the sort is stable. Passes where every key has the same
+// digit are skipped. Needs a scratch copy of the keys, returns false if it can't be allocated
+template <typename Ty>
+bool parallelRadixSort(JobDispatcher* dispatcher, Ty* keys, size_t count, size_t grain = PARALLEL_MIN_GRAIN)
+{
+	typedef typename RadixKey<Ty>::Bits Bits;
+	const int numPasses = (int)(sizeof(Bits)*8/RADIX_BITS);
+
+	ParallelChunks chunks = makeParallelChunks(dispatcher, count, grain);
+	if(chunks.numChunks <= 1)
+	{
+		std::sort(keys, keys + count, [](const Ty& a, const Ty& b) { return RadixKey<Ty>::toBits(a) < RadixKey<Ty>::toBits(b); });
+		return true;
+	}
+
+	ParallelBuffer<Ty> scratch(count);
+	ParallelBuffer<size_t> offsets((size_t)chunks.numChunks*RADIX_BUCKETS);
+	if(!scratch.data || !offsets.data)
+		return false;
+
+	Ty* src = keys;
+	Ty* dst = scratch.data;
+	for(int pass = 0; pass < numPasses; pass++)
+	{
+		int shift = pass*RADIX_BITS;
+
+		parallelForChunks(dispatcher, chunks, [&](uint32_t chunk, size_t begin, size_t end)
+		{
+			size_t* hist = offsets.data + (size_t)chunk*RADIX_BUCKETS;
+			memset(hist, 0x00, sizeof(size_t)*RADIX_BUCKETS);
+			for(size_t i = begin; i < end; i++)
+				hist[(RadixKey<Ty>::toBits(src[i]) >> shift) & (RADIX_BUCKETS - 1)]++;
+		});
+
+		// Digit major, chunk minor, keeps equal digits in input order
+		size_t total = 0;
+		bool trivial = false;
+		for(uint32_t d = 0; d < RADIX_BUCKETS && !trivial; d++)
+		{
+			size_t digitStart = total;
+			for(uint32_t c = 0; c < chunks.numChunks; c++)
+			{
+				size_t n = offsets.data[(size_t)c*RADIX_BUCKETS + d];
+				offsets.data[(size_t)c*RADIX_BUCKETS + d] = total;
+				total += n;
+			}
+			trivial = total - digitStart == count;
+		}
+		if(trivial)
+			continue;
+
+		parallelForChunks(dispatcher, chunks, [&](uint32_t chunk, size_t begin, size_t end)
+		{
+			size_t* offset = offsets.data + (size_t)chunk*RADIX_BUCKETS;
+			for(size_t i = begin; i < end; i++)
+				dst[offset[(RadixKey<Ty>::toBits(src[i]) >> shift) & (RADIX_BUCKETS - 1)]++] = src[i];
+		});
+		std::swap(src, dst);
+	}
+
+	if(src != keys)
+	{
+		parallelForChunks(dispatcher, chunks, [&](uint32_t, size_t begin, size_t end)
+		{
+			std::copy(src + begin, src + end, keys + begin);
+		});
+	}
+	return true;
+}
+
+// Number of elements taken from a in the first k of the stable merge of a and b
+template <typename Ty, typename Less>
+size_t mergeCoRank(size_t k, const Ty* a, size_t numA, const Ty* b, size_t numB, Less& less)
+{
+	size_t lo = k > numB ? k - numB : 0;
+	size_t hi = k < numA ? k : numA;
+	while(lo < hi)
+	{
+		size_t i = (lo + hi + 1)/2;
+		if(less(b[k - i], a[i - 1]))
+			hi = i - 1;
+		else
+			lo = i;
+	}
+	return lo;
+}
+
+// Stable. Chunks are sorted on their own, then runs are merged pairwise, every round split evenly
+// over the jobs by output position. Needs a scratch copy, returns false if it can't be allocated
+template <typename Ty, typename Less>
+bool parallelMergeSort(JobDispatcher* dispatcher, Ty* data, size_t count, Less less, size_t grain = PARALLEL_MIN_GRAIN)
+{
+	ParallelChunks chunks = makeParallelChunks(dispatcher, count, grain);
+	if(chunks.numChunks <= 1)
+	{
+		std::stable_sort(data, data + count, less);
+		return true;
+	}
+
+	ParallelBuffer<Ty> scratch(count);
+	if(!scratch.data)
+		return false;
+
+	parallelForChunks(dispatcher, chunks, [&](uint32_t, size_t begin, size_t end)
+	{
+		std::stable_sort(data + begin, data + end, less);
+	});
+
+	Ty* src = data;
+	Ty* dst = scratch.data;
+	for(size_t width = chunks.chunkSize; width < count; width *= 2)
+	{
+		parallelForChunks(dispatcher, chunks, [&](uint32_t, size_t begin, size_t end)
+		{
+			// The output range may cover the tail of one pair and the head of the next
+			while(begin < end)
+			{
+				size_t pairStart = begin - begin%(2*width);
+				size_t numA = count - pairStart < width ? count - pairStart : width;
+				size_t numB = count - pairStart - numA < width ? count - pairStart - numA : width;
+				const Ty* a = src + pairStart;
+				const Ty* b = a + numA;
+
+				size_t pairEnd = pairStart + numA + numB;
+				size_t stop = end < pairEnd ? end : pairEnd;
+				size_t k = begin - pairStart;
+				size_t i = mergeCoRank(k, a, numA, b, numB, less);
+				size_t j = k - i;
+				for(size_t o = begin; o < stop; o++)
+				{
+					if(j < numB && (i >= numA || less(b[j], a[i])))
+						dst[o] = b[j++];
+					else
+						dst[o] = a[i++];
+				}
+				begin = stop;
+			}
+		});
+		std::swap(src, dst);
+	}
+
+	if(src != data)
+	{
+		parallelForChunks(dispatcher, chunks, [&](uint32_t, size_t begin, size_t end)
+		{
+			std::copy(src + begin, src + end, data + begin);
+		});
+	}
+	return true;
+}
+
+// Radix sort for integer and float keys, merge sort with a comparator
+template <typename Ty>
+bool parallelSort(JobDispatcher* dispatcher, Ty* keys, size_t count)
+{
+	return parallelRadixSort(dispatcher, keys, count);
+}
+
+template <typename Ty, typename Less>
+bool parallelSort(JobDispatcher* dispatcher, Ty* data, size_t count, Less less)
+{
+	return parallelMergeSort(dispatcher, data, count, less);
+}
+
+// Stable, moves the elements matching pred to the front and returns how many there are
+// Without memory for the scratch copy it falls back to std::stable_partition on the calling thread
+template <typename Ty, typename Pred>
+size_t parallelPartition(JobDispatcher* dispatcher, Ty* data, size_t count, Pred pred, size_t grain = PARALLEL_MIN_GRAIN)
+{
+	ParallelChunks chunks = makeParallelChunks(dispatcher, count, grain);
+	ParallelBuffer<Ty> scratch(chunks.numChunks > 1 ? count : 0);
+	ParallelBuffer<size_t> offsets((size_t)chunks.numChunks*2);
+	if(chunks.numChunks <= 1 || !scratch.data || !offsets.data)
+		return (size_t)(std::stable_partition(data, data + count, pred) - data);
+
+	parallelForChunks(dispatcher, chunks, [&](uint32_t chunk, size_t begin, size_t end)
+	{
+		size_t n = 0;
+		for(size_t i = begin; i < end; i++)
+			n += pred(data[i]) ? 1 : 0;
+		offsets.data[chunk] = n;
+	});
+
+	// First half matching offsets, second half the others, which start after every match
+	size_t numTrue = 0;
+	for(uint32_t c = 0; c < chunks.numChunks; c++)
+	{
+		size_t n = offsets.data[c];
+		offsets.data[c] = numTrue;
+		numTrue += n;
+	}
+	for(uint32_t c = 0; c < chunks.numChunks; c++)
+	{
+		size_t begin, end;
+		chunks.getRange(c, &begin, &end);
+		offsets.data[chunks.numChunks + c] = numTrue + begin - offsets.data[c];
+	}
+
+	parallelForChunks(dispatcher, chunks, [&](uint32_t chunk, size_t begin, size_t end)
+	{
+		size_t t = offsets.data[chunk];
+		size_t f = offsets.data[chunks.numChunks + chunk];
+		for(size_t i = begin; i < end; i++)
+		{
+			if(pred(data[i]))
+				scratch.data[t++] = data[i];
+			else
+				scratch.data[f++] = data[i];
+		}
+	});
+
+	parallelForChunks(dispatcher, chunks, [&](uint32_t, size_t begin, size_t end)
+	{
+		std::copy(scratch.data + begin, scratch.data + end, data + begin);
+	});
+	return numTrue;
+}
+
+// Default dispatcher
+template <typename Ty, typename Op>
+Ty parallelReduce(const Ty* data, size_t count, Ty init, Op op)
+{
+	return parallelReduce((JobDispatcher*)nullptr, data, count, init, op);
+}
+
+template <typename Ty, typename Op>
+void parallelInclusiveScan(const Ty* in, Ty* out, size_t count, Op op)
+{
+	parallelInclusiveScan((JobDispatcher*)nullptr, in, out, count, op);
+}
+
+template <typename Ty, typename Op>
+void parallelExclusiveScan(const Ty* in, Ty* out, size_t count, Ty init, Op op)
+{
+	parallelExclusiveScan((JobDispatcher*)nullptr, in, out, count, init, op);
+}
+
+template <typename Ty>
+bool parallelSort(Ty* keys, size_t count)
+{
+	return parallelRadixSort((JobDispatcher*)nullptr, keys, count);
+}
+
+template <typename Ty, typename Less>
+bool parallelSort(Ty* data, size_t count, Less less)
+{
+	return parallelMergeSort((JobDispatcher*)nullptr, data, count, less);
+}
+
+template <typename Ty, typename Pred>
+size_t parallelPartition(Ty* data, size_t count, Pred pred)
+{
+	return parallelPartition((JobDispatcher*)nullptr, data, count, pred);
+}
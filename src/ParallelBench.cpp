@@ -0,0 +1,145 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <numeric>
+#include <functional>
+
+#include "ParallelAlgorithms.hpp"
+
+// Benchmarks of the parallel algorithms against the standard library on the default dispatcher
+// Sizes go from 1M up to maxCount elements, ten times more each round
+
+static double toMs(int64_t ticks)
+{
+	return 1000.0*(double)ticks/(double)getHPFrequency();
+}
+
+static uint32_t nextRandom(uint32_t* state)
+{
+	// xorshift32
+	uint32_t x = *state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	*state = x;
+	return x;
+}
+
+static void printResult(const char* name, size_t count, double stdMs, double parMs, bool ok)
+{
+	printf("%-16s %10zu %10.2f %10.2f %7.2fx %s\n", name, count, stdMs, parMs, parMs > 0.0 ? stdMs/parMs : 0.0, ok ? "" : "MISMATCH");
+}
+
+static void benchReduce(const uint64_t* data, size_t count)
+{
+	int64_t t0 = getHPCounter();
+#if __cplusplus >= 201703L || (defined(_MSVC_LANG) && _MSVC_LANG >= 201703L)
+	uint64_t ref = std::reduce(data, data + count, (uint64_t)0);
+#else
+	uint64_t ref = std::accumulate(data, data + count, (uint64_t)0);
+#endif
+	int64_t t1 = getHPCounter();
+	uint64_t sum = parallelReduce(data, count, (uint64_t)0, std::plus<uint64_t>());
+	int64_t t2 = getHPCounter();
+	printResult("reduce", count, toMs(t1 - t0), toMs(t2 - t1), sum == ref);
+}
+
+static void benchScan(const uint64_t* data, uint64_t* out, uint64_t* ref, size_t count)
+{
+	int64_t t0 = getHPCounter();
+	std::partial_sum(data, data + count, ref);
+	int64_t t1 = getHPCounter();
+	parallelInclusiveScan(data, out, count, std::plus<uint64_t>());
+	int64_t t2 = getHPCounter();
+	printResult("inclusive scan", count, toMs(t1 - t0), toMs(t2 - t1), std::equal(out, out + count, ref));
+
+	// Compared against partial_sum as well, std::exclusive_scan needs C++17
+	int64_t t3 = getHPCounter();
+	parallelExclusiveScan(data, out, count, (uint64_t)0, std::plus<uint64_t>());
+	int64_t t4 = getHPCounter();
+	bool ok = count == 0 || (out[0] == 0 && std::equal(out + 1, out + count, ref));
+	printResult("exclusive scan", count, toMs(t1 - t0), toMs(t4 - t3), ok);
+}
+
+template <typename Ty>
+static void benchSort(const char* name, const Ty* data, Ty* keys, Ty* ref, size_t count, bool radix)
+{
+	std::copy(data, data + count, ref);
+	int64_t t0 = getHPCounter();
+	std::sort(ref, ref + count);
+	int64_t t1 = getHPCounter();
+
+	std::copy(data, data + count, keys);
+	int64_t t2 = getHPCounter();
+	bool sorted = radix ? parallelSort(keys, count) : parallelSort(keys, count, std::less<Ty>());
+	int64_t t3 = getHPCounter();
+	printResult(name, count, toMs(t1 - t0), toMs(t3 - t2), sorted && std::equal(keys, keys + count, ref));
+}
+
+static void benchPartition(const uint32_t* data, uint32_t* keys, uint32_t* ref, size_t count)
+{
+	struct IsEven
+	{
+		bool operator()(uint32_t v) const { return (v & 1) == 0; }
+	};
+
+	std::copy(data, data + count, ref);
+	int64_t t0 = getHPCounter();
+	size_t refSplit = (size_t)(std::stable_partition(ref, ref + count, IsEven()) - ref);
+	int64_t t1 = getHPCounter();
+
+	std::copy(data, data + count, keys);
+	int64_t t2 = getHPCounter();
+	size_t split = parallelPartition(keys, count, IsEven());
+	int64_t t3 = getHPCounter();
+	printResult("partition", count, toMs(t1 - t0), toMs(t3 - t2), split == refSplit && std::equal(keys, keys + count, ref));
+}
+
+int runParallelBenchmarks(size_t maxCount)
+{
+	if(!initJobDispatcher())
+		return 1;
+
+	printf("%-16s %10s %10s %10s %8s\n", "algorithm", "elements", "std ms", "walo ms", "speedup");
+	for(size_t count = 1000000; count <= maxCount; count *= 10)
+	{
+		uint64_t* data64 = (uint64_t*)malloc(sizeof(uint64_t)*count*3);
+		uint32_t* data32 = (uint32_t*)malloc(sizeof(uint32_t)*count*3);
+		float* dataF = (float*)malloc(sizeof(float)*count*3);
+		if(!data64 || !data32 || !dataF)
+		{
+			printf("out of memory at %zu elements\n", count);
+			free(data64);
+			free(data32);
+			free(dataF);
+			break;
+		}
+
+		// Fault every page in up front, neither side should pay for first touch
+		memset(data64, 0x00, sizeof(uint64_t)*count*3);
+		memset(data32, 0x00, sizeof(uint32_t)*count*3);
+		memset(dataF, 0x00, sizeof(float)*count*3);
+
+		uint32_t seed = 0x12345678;
+		for(size_t i = 0; i < count; i++)
+		{
+			data32[i] = nextRandom(&seed);
+			data64[i] = data32[i] >> 8;
+			dataF[i] = (float)(int32_t)data32[i]/65536.0f;
+		}
+
+		benchReduce(data64, count);
+		benchScan(data64, data64 + count, data64 + 2*count, count);
+		benchSort("radix sort u32", data32, data32 + count, data32 + 2*count, count, true);
+		benchSort("radix sort f32", dataF, dataF + count, dataF + 2*count, count, true);
+		benchSort("merge sort u32", data32, data32 + count, data32 + 2*count, count, false);
+		benchPartition(data32, data32 + count, data32 + 2*count, count);
+
+		free(data64);
+		free(data32);
+		free(dataF);
+	}
+
+	shutdownJobDispatcher();
+	return 0;
+}
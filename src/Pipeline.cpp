@@ -0,0 +1,321 @@
+#include <new>
+
+#include "Pipeline.hpp"
+#include "Ring.hpp"
+
+extern JobDispatcher* g_dispatcher;
+
+struct Pipeline;
+
+// An item on its way through the stages, maxTokens of them are preallocated
+struct PipelineToken
+{
+	Pipeline* pipeline;
+	void* item;         // Null once a stage dropped it, it still passes the serial stages in order
+	uint32_t seq;       // Input order
+	int32_t index;      // In Pipeline::tokens
+	uint8_t stage;      // Next stage to run
+	bool ownsStage;     // Handed a serial stage by the token before it, goes in without queueing
+};
+
+struct PipelineStage
+{
+	PipelineStageDesc desc;
+
+	// SerialInOrder: the token allowed in next, the ones arriving early park in slots[seq & slotMask]
+	// Parked tokens are less than maxTokens apart, so they never share a slot
+	volatile int32_t nextSeq;
+	PipelineToken* volatile* slots;
+
+	// SerialOutOfOrder: set while a token is in, the ones arriving meanwhile queue up
+	volatile int32_t busy;
+	MpmcRing<PipelineToken*> waiting;
+};
+
+struct Pipeline
+{
+	PipelineStage stages[MAX_PIPELINE_STAGES];
+	uint8_t numStages;
+	uint32_t maxTokens;
+	uint32_t slotMask;
+	JobPriority::Enum priority;
+
+	PipelineToken* tokens;
+	IndexStack freeTokens;
+	volatile int32_t inFlight;
+	volatile int32_t inputBusy;     // One job reads the input at a time
+	volatile int32_t inputDone;
+	uint32_t nextInputSeq;          // Under inputBusy
+};
+
+static void runToken(PipelineToken* token);
+static void pumpInput(Pipeline* pipeline);
+
+static void tokenJob(int jobIndex, void* userParam)
+{
+	PipelineToken* token = (PipelineToken*)userParam;
+	Pipeline* pipeline = token->pipeline;
+	runToken(token);
+	pumpInput(pipeline);
+}
+
+static void inputJob(int jobIndex, void* userParam)
+{
+	pumpInput((Pipeline*)userParam);
+}
+
+// Jobs go on the handle of the running pipeline job, so runPipeline waits for them too
+static void spawnJob(Pipeline* pipeline, JobCallback callback, void* userParam)
+{
+	JobDesc job(callback, userParam, pipeline->priority);
+	if(!appendJobs(&job, 1))
+	{
+		// Out of jobs, carry on here
+		callback(0, userParam);
+	}
+}
+
+static bool enterInOrder(PipelineStage* stage, PipelineToken* token)
+{
+	if((uint32_t)atomicLoadAcquire(&stage->nextSeq) == token->seq)
+		return true;
+
+	// Park, then look again in case the stage moved on to us meanwhile. The leaving token bumps
+	// nextSeq before it looks at the slot, so at least one of the two sees the other
+	PipelineToken* volatile* slot = &stage->slots[token->seq & token->pipeline->slotMask];
+	*slot = token;
+	atomicFence();
+	return (uint32_t)atomicLoadAcquire(&stage->nextSeq) == token->seq &&
+		atomicCompareAndSwapPtr((void* volatile*)slot, token, nullptr) == token;
+}
+
+// Lets the next token in, returns it if it's parked already, it owns the stage then
+static PipelineToken* leaveInOrder(PipelineStage* stage, PipelineToken* token)
+{
+	uint32_t next = token->seq + 1;
+	atomicFetchAndAdd(&stage->nextSeq, 1);
+
+	PipelineToken* volatile* slot = &stage->slots[next & token->pipeline->slotMask];
+	PipelineToken* parked = *slot;
+	if(parked && parked->seq == next && atomicCompareAndSwapPtr((void* volatile*)slot, parked, nullptr) == parked)
+		return parked;
+	return nullptr;
+}
+
+// Hands the stage to a queued token, or lets go of it if there is none. Called with busy set
+static PipelineToken* takeWaiting(PipelineStage* stage)
+{
+	for(;;)
+	{
+		PipelineToken* token;
+		if(stage->waiting.pop(&token))
+			return token;
+
+		// A token that queued after the pop may have found the stage still busy
+		atomicStoreRelease(&stage->busy, 0);
+		atomicFence();
+		if(stage->waiting.isEmpty() || atomicCompareAndSwap(&stage->busy, 0, 1) != 0)
+			return nullptr;
+	}
+}
+
+static bool enterAnyOrder(PipelineStage* stage, PipelineToken* token)
+{
+	if(atomicCompareAndSwap(&stage->busy, 0, 1) == 0)
+		return true;
+
+	// Queue up, then try again in case the stage was left meanwhile. The ring has room for
+	// every token, it can't be full
+	stage->waiting.push(token);
+	if(atomicCompareAndSwap(&stage->busy, 0, 1) != 0)
+		return false;
+
+	PipelineToken* next = takeWaiting(stage);
+	if(next == token)
+		return true;
+	if(next)
+	{
+		// Someone queued before us, it goes first
+		next->ownsStage = true;
+		spawnJob(token->pipeline, tokenJob, next);
+	}
+	return false;
+}
+
+// Carries the token through the stages until it's done, or parks it at a serial stage that's taken
+// The token leaving that stage hands it over and spawns a job to carry it on
+static void runToken(PipelineToken* token)
+{
+	Pipeline* pipeline = token->pipeline;
+	for(; token->stage < pipeline->numStages; token->stage++)
+	{
+		PipelineStage* stage = &pipeline->stages[token->stage];
+		PipelineStageMode::Enum mode = stage->desc.mode;
+		bool owns = token->ownsStage;
+		token->ownsStage = false;
+
+		if(mode == PipelineStageMode::SerialInOrder && !owns && !enterInOrder(stage, token))
+			return;
+		if(mode == PipelineStageMode::SerialOutOfOrder && !owns && !enterAnyOrder(stage, token))
+			return;
+
+		if(token->item)
+			token->item = stage->desc.fn(token->item, stage->desc.userParam);
+
+		PipelineToken* next = nullptr;
+		if(mode == PipelineStageMode::SerialInOrder)
+			next = leaveInOrder(stage, token);
+		else if(mode == PipelineStageMode::SerialOutOfOrder)
+			next = takeWaiting(stage);
+
+		if(next)
+		{
+			next->ownsStage = true;
+			spawnJob(pipeline, tokenJob, next);
+		}
+	}
+
+	// Through, make room for the next input item
+	pipeline->freeTokens.push(token->index);
+	atomicFetchAndSub(&pipeline->inFlight, 1);
+}
+
+// Reads input while there are free tokens. Every item read spawns the next read, and this job
+// carries the item on meanwhile
+static void pumpInput(Pipeline* pipeline)
+{
+	for(;;)
+	{
+		if(pipeline->inputDone || atomicLoadAcquire(&pipeline->inFlight) >= (int32_t)pipeline->maxTokens)
+			return;
+
+		// Whoever reads now looks again after letting go
+		if(atomicCompareAndSwap(&pipeline->inputBusy, 0, 1) != 0)
+			return;
+
+		PipelineToken* token = nullptr;
+		if(!pipeline->inputDone && pipeline->inFlight < (int32_t)pipeline->maxTokens)
+		{
+			const PipelineStageDesc& input = pipeline->stages[0].desc;
+			void* item = input.fn(nullptr, input.userParam);
+			if(item)
+			{
+				// A token is free, at most maxTokens are in flight
+				token = &pipeline->tokens[pipeline->freeTokens.pop()];
+				token->item = item;
+				token->seq = pipeline->nextInputSeq++;
+				token->stage = 1;
+				token->ownsStage = false;
+				atomicFetchAndAdd(&pipeline->inFlight, 1);
+			}
+			else
+			{
+				pipeline->inputDone = 1;
+			}
+		}
+		atomicStoreRelease(&pipeline->inputBusy, 0);
+		atomicFence();
+
+		if(token)
+		{
+			if(!pipeline->inputDone && pipeline->inFlight < (int32_t)pipeline->maxTokens)
+				spawnJob(pipeline, inputJob, pipeline);
+			runToken(token);
+		}
+	}
+}
+
+static void destroyPipeline(Pipeline* pipeline)
+{
+	for(uint8_t i = 0; i < pipeline->numStages; i++)
+	{
+		PipelineStage& stage = pipeline->stages[i];
+		free((void*)stage.slots);
+		stage.waiting.destroy();
+	}
+	pipeline->freeTokens.destroy();
+	delete[] pipeline->tokens;
+	delete pipeline;
+}
+
+static Pipeline* createPipeline(const PipelineDesc* desc)
+{
+	Pipeline* pipeline = new(std::nothrow) Pipeline();
+	if(!pipeline)
+		return nullptr;
+
+	uint32_t numSlots = 1;
+	while(numSlots < desc->maxTokens)
+		numSlots <<= 1;
+
+	pipeline->numStages = desc->numStages;
+	pipeline->maxTokens = desc->maxTokens;
+	pipeline->slotMask = numSlots - 1;
+	pipeline->priority = desc->priority;
+	pipeline->inFlight = 0;
+	pipeline->inputBusy = 0;
+	pipeline->inputDone = 0;
+	pipeline->nextInputSeq = 0;
+	pipeline->tokens = new(std::nothrow) PipelineToken[desc->maxTokens];
+
+	bool ok = pipeline->tokens && pipeline->freeTokens.create((int32_t)desc->maxTokens, true);
+	for(uint32_t i = 0; ok && i < desc->maxTokens; i++)
+	{
+		pipeline->tokens[i].pipeline = pipeline;
+		pipeline->tokens[i].index = (int32_t)i;
+	}
+
+	for(uint8_t i = 0; i < desc->numStages; i++)
+	{
+		PipelineStage& stage = pipeline->stages[i];
+		stage.desc = desc->stages[i];
+		stage.nextSeq = 0;
+		stage.busy = 0;
+		stage.slots = nullptr;
+		if(!ok || i == 0)
+			continue;
+
+		if(stage.desc.mode == PipelineStageMode::SerialInOrder)
+		{
+			stage.slots = (PipelineToken* volatile*)malloc(sizeof(PipelineToken*)*numSlots);
+			ok = stage.slots != nullptr;
+			if(ok)
+				memset((void*)stage.slots, 0x00, sizeof(PipelineToken*)*numSlots);
+		}
+		else if(stage.desc.mode == PipelineStageMode::SerialOutOfOrder)
+		{
+			ok = stage.waiting.create(desc->maxTokens);
+		}
+	}
+
+	if(!ok)
+	{
+		destroyPipeline(pipeline);
+		return nullptr;
+	}
+	return pipeline;
+}
+
+bool runPipeline(JobDispatcher* dispatcher, const PipelineDesc* desc)
+{
+	if(!dispatcher || desc->numStages == 0 || desc->numStages > MAX_PIPELINE_STAGES || desc->maxTokens == 0)
+		return false;
+
+	Pipeline* pipeline = createPipeline(desc);
+	if(!pipeline)
+		return false;
+
+	// Every other pipeline job gets appended to this one's handle
+	JobDesc job(inputJob, pipeline, desc->priority);
+	JobHandle handle = dispatchJobs(dispatcher, &job, 1);
+	if(handle)
+		waitJobs(handle);
+
+	destroyPipeline(pipeline);
+	return handle != nullptr;
+}
+
+bool runPipeline(const PipelineDesc* desc)
+{
+	return runPipeline(g_dispatcher, desc);
+}
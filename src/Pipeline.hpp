@@ -0,0 +1,70 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "JobDispatcher.hpp"
+
+#define MAX_PIPELINE_STAGES 16
+
+struct PipelineStageMode
+{
+	enum Enum
+	{
+		Parallel = 0,       // Any number of items at once, in any order
+		SerialInOrder,      // One item at a time, in input order
+		SerialOutOfOrder,   // One item at a time, in whatever order they arrive
+	};
+};
+
+// Gets the previous stage's item and returns the one for the next stage
+// The input stage gets nullptr and returns the next item, or nullptr at the end of the input
+// A later stage returning nullptr drops the item, the stages after it aren't called for it
+typedef void* (*PipelineStageFn)(void* item, void* userParam);
+
+struct PipelineStageDesc
+{
+	PipelineStageFn fn;
+	void* userParam;
+	PipelineStageMode::Enum mode;
+
+	PipelineStageDesc()
+	{
+		fn = nullptr;
+		userParam = nullptr;
+		mode = PipelineStageMode::Parallel;
+	}
+};
+
+struct PipelineDesc
+{
+	PipelineStageDesc stages[MAX_PIPELINE_STAGES];  // stages[0] is the input, it always runs serially in order
+	uint8_t numStages;
+
+	// Items between the input and the end at most. Bounds memory, and a stalled stage holds
+	// the input back once it's reached instead of piling up work
+	uint32_t maxTokens;
+	JobPriority::Enum priority;
+
+	PipelineDesc()
+	{
+		numStages = 0;
+		maxTokens = 16;
+		priority = JobPriority::Normal;
+	}
+
+	bool addStage(PipelineStageFn fn, PipelineStageMode::Enum mode, void* userParam = nullptr)
+	{
+		if(numStages >= MAX_PIPELINE_STAGES)
+			return false;
+		stages[numStages].fn = fn;
+		stages[numStages].userParam = userParam;
+		stages[numStages].mode = mode;
+		numStages++;
+		return true;
+	}
+};
+
+// Runs the stages as jobs on the dispatcher's workers until the input ends and every item went
+// through, and waits for it like waitJobs. Returns false if the pipeline couldn't be started
+bool runPipeline(JobDispatcher* dispatcher, const PipelineDesc* desc);
+bool runPipeline(const PipelineDesc* desc);
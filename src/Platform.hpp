@@ -8,4 +8,6 @@
 
 #if defined(_WIN32) || defined(_WIN64)
 #define WALO_PLATFORM_WINDOWS
+#elif defined(__unix__) || defined(__unix) || (defined(__APPLE__) && defined(__MACH__))
+#define WALO_PLATFORM_POSIX
 #endif
\ No newline at end of file
@@ -1,8 +1,36 @@
 #pragma once
 
+#include <stdint.h>
+#include <stdlib.h>
 #include <malloc.h>
 #include <memory>
 
+#include "Platform.hpp"
+#include "Lock.hpp"
+#include "Thread.hpp"
+#include "IndexStack.hpp"
+
+inline void* alignedAlloc(size_t _size, size_t _align)
+{
+#ifdef WALO_COMPILER_MSVC
+	return _aligned_malloc(_size, _align);
+#else
+	void* ptr = nullptr;
+	if(posix_memalign(&ptr, _align, _size) != 0)
+		return nullptr;
+	return ptr;
+#endif
+}
+
+inline void alignedFree(void* _ptr)
+{
+#ifdef WALO_COMPILER_MSVC
+	_aligned_free(_ptr);
+#else
+	free(_ptr);
+#endif
+}
+
 template <typename Ty>
 class FixedPool
 {
@@ -72,6 +100,7 @@ public:
 	}
 
 	int getMaxItems() const { return m_maxItems; }
+	int getNumFree() const { return m_index; }
 
 private:
 	Ty* m_buffer;
@@ -80,6 +109,10 @@ private:
 	int m_index;
 };
 
+// Growing pool made of fixed size buckets
+// Every bucket is allocated on a power-of-two boundary equal to its size, so the bucket owning an
+// instance is found by masking the instance address. Buckets with free slots are kept in a separate
+// list, which makes both newInstance and deleteInstance O(1). Not thread-safe, see ConcurrentPool
 template <typename Ty>
 class Pool
 {
@@ -87,13 +120,27 @@ public:
 	Pool()
 	{
 		m_firstBucket = nullptr;
+		m_freeBucket = nullptr;
 		m_numBuckets = 0;
 		m_maxItemsPerBucket = 0;
+		m_bucketSize = 0;
+		m_bufferOffset = 0;
 	}
 
+	// _bucketSize is the minimum number of items per bucket, the remainder of the power-of-two block is also used
 	bool create(int _bucketSize)
 	{
-		m_maxItemsPerBucket = _bucketSize;
+		size_t ptrsOffset = alignUp(sizeof(Bucket), sizeof(void*));
+		size_t itemSize = sizeof(Ty) + sizeof(Ty*);
+		size_t minSize = ptrsOffset + itemSize*_bucketSize + alignof(Ty);
+
+		size_t bucketSize = 64;
+		while(bucketSize < minSize)
+			bucketSize <<= 1;
+
+		m_bucketSize = bucketSize;
+		m_maxItemsPerBucket = (int)((bucketSize - ptrsOffset - alignof(Ty)) / itemSize);
+		m_bufferOffset = alignUp(ptrsOffset + sizeof(Ty*)*m_maxItemsPerBucket, alignof(Ty));
 
 		if(!createBucket())
 			return false;
@@ -110,50 +157,56 @@ public:
 			destroyBucket(b);
 			b = next;
 		}
+		m_firstBucket = nullptr;
+		m_freeBucket = nullptr;
 	}
 
 	template <typename ... _ConstructorParams>
 	Ty* newInstance(_ConstructorParams ... params)
 	{
-		Bucket* b = m_firstBucket;
-		while(b)
-		{
-			if(b->iter > 0)
-				return new(b->ptrs[--b->iter]) Ty(params ...);
-			b = b->next;
-		}
-
-		b = createBucket();
-		if(!b)
+		void* ptr = allocate();
+		if(!ptr)
 			return nullptr;
-
-		return new(b->ptrs[--b->iter]) Ty(params ...);
+		return new(ptr) Ty(params ...);
 	}
 
 	void deleteInstance(Ty* _inst)
 	{
 		_inst->~Ty();
+		deallocate(_inst);
+	}
 
-		Bucket* b = m_firstBucket;
-		size_t buffer_sz = sizeof(Ty)*m_maxItemsPerBucket;
-		uint8_t* u8ptr = (uint8_t*)_inst;
-
-		while(b)
+	// Raw slot, no constructor is called
+	void* allocate()
+	{
+		Bucket* b = m_freeBucket;
+		if(!b)
 		{
-			if(u8ptr >= b->buffer && u8ptr < (b->buffer + buffer_sz))
-			{
-				b->ptrs[b->iter++] = _inst;
-				return;
-			}
-
-			b = b->next;
+			b = createBucket();
+			if(!b)
+				return nullptr;
 		}
+
+		Ty* ptr = b->ptrs[--b->iter];
+		if(b->iter == 0)
+			unlinkFree(b);
+		return ptr;
+	}
+
+	// Raw slot, no destructor is called
+	void deallocate(void* _ptr)
+	{
+		Bucket* b = getBucket(_ptr);
+		if(b->iter == 0)
+			linkFree(b);
+		b->ptrs[b->iter++] = (Ty*)_ptr;
 	}
 
 	void clear()
 	{
 		int bucket_size = m_maxItemsPerBucket;
 
+		m_freeBucket = nullptr;
 		Bucket* b = m_firstBucket;
 		while(b)
 		{
@@ -161,6 +214,7 @@ public:
 			for(int i = 0; i < bucket_size; i++)
 				b->ptrs[bucket_size - i - 1] = (Ty*)b->buffer + i;
 			b->iter = bucket_size;
+			linkFree(b);
 
 			b = b->next;
 		}
@@ -179,30 +233,44 @@ public:
 		return count;
 	}
 
+	int getMaxItemsPerBucket() const { return m_maxItemsPerBucket; }
+	int getMaxItems() const { return m_numBuckets*m_maxItemsPerBucket; }
+	int getNumFree() const { return getMaxItems() - getLeakCount(); }
+
 private:
 	struct Bucket
 	{
 		Bucket* prev;
 		Bucket* next;
+		Bucket* freePrev;   // Buckets that have free slots
+		Bucket* freeNext;
 		uint8_t* buffer;
 		Ty** ptrs;
 		int iter;
 	};
 
 private:
+	static size_t alignUp(size_t _value, size_t _align)
+	{
+		return (_value + _align - 1) & ~(_align - 1);
+	}
+
+	Bucket* getBucket(void* _ptr) const
+	{
+		return (Bucket*)((uintptr_t)_ptr & ~(uintptr_t)(m_bucketSize - 1));
+	}
+
 	Bucket * createBucket()
 	{
-		size_t total_sz = sizeof(Bucket) + sizeof(Ty)*m_maxItemsPerBucket + sizeof(void*)*m_maxItemsPerBucket;
-		uint8_t* buff = (uint8_t*)malloc(total_sz);
+		uint8_t* buff = (uint8_t*)alignedAlloc(m_bucketSize, m_bucketSize);
 		if(!buff)
 			return nullptr;
-		memset(buff, 0x00, total_sz);
+		memset(buff, 0x00, m_bucketSize);
 
+		// Layout: [Bucket][ptrs][items], the whole block is m_bucketSize aligned
 		Bucket* bucket = (Bucket*)buff;
-		buff += sizeof(Bucket);
-		bucket->buffer = buff;
-		buff += sizeof(Ty)*m_maxItemsPerBucket;
-		bucket->ptrs = (Ty**)buff;
+		bucket->ptrs = (Ty**)(buff + alignUp(sizeof(Bucket), sizeof(void*)));
+		bucket->buffer = buff + m_bufferOffset;
 
 		// Assign pointer references
 		for(int i = 0, c = m_maxItemsPerBucket; i < c; i++)
@@ -217,6 +285,7 @@ private:
 			bucket->next = m_firstBucket;
 		}
 		m_firstBucket = bucket;
+		linkFree(bucket);
 
 		m_numBuckets++;
 		return bucket;
@@ -240,12 +309,324 @@ private:
 		}
 
 		//
-		free(bucket);
+		alignedFree(bucket);
 		m_numBuckets--;
 	}
 
+	void linkFree(Bucket* bucket)
+	{
+		bucket->freePrev = nullptr;
+		bucket->freeNext = m_freeBucket;
+		if(m_freeBucket)
+			m_freeBucket->freePrev = bucket;
+		m_freeBucket = bucket;
+	}
+
+	void unlinkFree(Bucket* bucket)
+	{
+		if(bucket->freeNext)
+			bucket->freeNext->freePrev = bucket->freePrev;
+		if(bucket->freePrev)
+			bucket->freePrev->freeNext = bucket->freeNext;
+		else
+			m_freeBucket = bucket->freeNext;
+		bucket->freePrev = bucket->freeNext = nullptr;
+	}
+
 private:
 	int m_maxItemsPerBucket;
 	int m_numBuckets;
+	size_t m_bucketSize;        // Power of two, also the alignment of every bucket
+	size_t m_bufferOffset;
 	Bucket* m_firstBucket;
+	Bucket* m_freeBucket;
+};
+
+// Thread-safe Pool with per-thread magazine caches (Bonwick's magazine allocator)
+// Each thread holds two magazines (small stacks of free instances). Allocations and frees are
+// served from them without any shared writes. When both are exhausted (or full), the thread
+// exchanges a magazine with the depot, which is a pair of lock-free stacks of full and empty
+// magazines. The backing Pool is only locked when the depot itself runs dry.
+// A thread that used the pool gives its magazines back with flushCache before it exits, else they
+// and the instances in them are stranded until destroy()
+template <typename Ty, int MagazineSize = 32>
+class ConcurrentPool
+{
+public:
+	ConcurrentPool()
+	{
+		m_magazines = nullptr;
+		m_maxMagazines = 0;
+		m_caches = nullptr;
+	}
+
+	// _maxMagazines bounds the depot; two magazines are handed to each thread on first use
+	bool create(int _bucketSize, int _maxMagazines = 256)
+	{
+		if(!m_pool.create(_bucketSize))
+			return false;
+
+		m_magazines = (Magazine*)malloc(sizeof(Magazine)*_maxMagazines);
+		if(!m_magazines)
+			return false;
+		memset(m_magazines, 0x00, sizeof(Magazine)*_maxMagazines);
+		m_maxMagazines = _maxMagazines;
+
+		if(!m_fullMagazines.create(_maxMagazines) ||
+			!m_emptyMagazines.create(_maxMagazines, true))
+		{
+			return false;
+		}
+
+		return true;
+	}
+
+	void destroy()
+	{
+		Cache* c = m_caches;
+		while(c)
+		{
+			Cache* next = c->next;
+			free(c);
+			c = next;
+		}
+		m_caches = nullptr;
+
+		m_fullMagazines.destroy();
+		m_emptyMagazines.destroy();
+		if(m_magazines)
+		{
+			free(m_magazines);
+			m_magazines = nullptr;
+		}
+		m_maxMagazines = 0;
+
+		m_pool.destroy();
+	}
+
+	template <typename ... _ConstructorParams>
+	Ty* newInstance(_ConstructorParams ... params)
+	{
+		void* ptr = allocate();
+		if(!ptr)
+			return nullptr;
+		return new(ptr) Ty(params ...);
+	}
+
+	void deleteInstance(Ty* _inst)
+	{
+		_inst->~Ty();
+		deallocate(_inst);
+	}
+
+	template <typename ... _ConstructorParams>
+	Ty* newInstanceUncached(_ConstructorParams ... params)
+	{
+		void* ptr = allocateUncached();
+		if(!ptr)
+			return nullptr;
+		return new(ptr) Ty(params ...);
+	}
+
+	void* allocate()
+	{
+		Cache* c = getCache();
+		if(!c)
+			return nullptr;
+
+		if(c->loaded && c->loaded->count > 0)
+			return c->loaded->items[--c->loaded->count];
+
+		if(c->previous && c->previous->count > 0)
+		{
+			swap(c);
+			return c->loaded->items[--c->loaded->count];
+		}
+
+		// Both magazines are empty, trade the previous one for a full magazine from the depot
+		int32_t full = m_fullMagazines.pop();
+		if(full >= 0)
+		{
+			if(c->previous)
+				m_emptyMagazines.push(indexOf(c->previous));
+			c->previous = c->loaded;
+			c->loaded = &m_magazines[full];
+			return c->loaded->items[--c->loaded->count];
+		}
+
+		return allocateSlow(c);
+	}
+
+	// Straight from and to the backing pool under the lock, for threads that shouldn't hold a cache
+	void* allocateUncached()
+	{
+		LockScope lk(m_lock);
+		return m_pool.allocate();
+	}
+
+	void deallocateUncached(void* _ptr)
+	{
+		deallocateSlow(_ptr);
+	}
+
+	// Returns the calling thread's magazines to the depot, its next allocation takes new ones
+	void flushCache()
+	{
+		Cache* c = (Cache*)m_tls.get();
+		if(!c)
+			return;
+		m_tls.set(nullptr);
+		releaseMagazine(c->loaded);
+		releaseMagazine(c->previous);
+
+		LockScope lk(m_lock);
+		Cache** link = &m_caches;
+		while(*link != c)
+			link = &(*link)->next;
+		*link = c->next;
+		free(c);
+	}
+
+	void deallocate(void* _ptr)
+	{
+		Cache* c = getCache();
+		if(!c)
+			return;
+
+		if(c->loaded && c->loaded->count < MagazineSize)
+		{
+			c->loaded->items[c->loaded->count++] = (Ty*)_ptr;
+			return;
+		}
+
+		if(c->previous && c->previous->count == 0)
+		{
+			swap(c);
+			c->loaded->items[c->loaded->count++] = (Ty*)_ptr;
+			return;
+		}
+
+		// Both magazines are full, trade the previous one for an empty magazine from the depot
+		int32_t empty = m_emptyMagazines.pop();
+		if(empty >= 0)
+		{
+			if(c->previous)
+				m_fullMagazines.push(indexOf(c->previous));
+			c->previous = c->loaded;
+			c->loaded = &m_magazines[empty];
+			c->loaded->count = 0;
+			c->loaded->items[c->loaded->count++] = (Ty*)_ptr;
+			return;
+		}
+
+		deallocateSlow(_ptr);
+	}
+
+private:
+	struct Magazine
+	{
+		int count;
+		Ty* items[MagazineSize];
+	};
+
+	struct Cache
+	{
+		Magazine* loaded;
+		Magazine* previous;
+		Cache* next;
+	};
+
+private:
+	Cache* getCache()
+	{
+		Cache* c = (Cache*)m_tls.get();
+		if(c)
+			return c;
+
+		c = (Cache*)malloc(sizeof(Cache));
+		if(!c)
+			return nullptr;
+		c->loaded = popEmpty();
+		c->previous = popEmpty();
+
+		LockScope lk(m_lock);
+		c->next = m_caches;
+		m_caches = c;
+		m_tls.set(c);
+		return c;
+	}
+
+	Magazine* popEmpty()
+	{
+		int32_t index = m_emptyMagazines.pop();
+		if(index < 0)
+			return nullptr;
+		m_magazines[index].count = 0;
+		return &m_magazines[index];
+	}
+
+	// Partly filled ones count as full, allocate only needs one instance in them
+	void releaseMagazine(Magazine* m)
+	{
+		if(!m)
+			return;
+		if(m->count > 0)
+			m_fullMagazines.push(indexOf(m));
+		else
+			m_emptyMagazines.push(indexOf(m));
+	}
+
+	void swap(Cache* c)
+	{
+		Magazine* m = c->loaded;
+		c->loaded = c->previous;
+		c->previous = m;
+	}
+
+	int32_t indexOf(Magazine* m) const
+	{
+		return (int32_t)(m - m_magazines);
+	}
+
+	// Depot has no full magazines, refill the loaded magazine from the backing pool in one go
+	void* allocateSlow(Cache* c)
+	{
+		LockScope lk(m_lock);
+		Magazine* m = c->loaded;
+		if(m)
+		{
+			while(m->count < MagazineSize)
+			{
+				void* ptr = m_pool.allocate();
+				if(!ptr)
+					break;
+				m->items[m->count++] = (Ty*)ptr;
+			}
+
+			if(m->count > 0)
+				return m->items[--m->count];
+			return nullptr;
+		}
+
+		return m_pool.allocate();
+	}
+
+	// Depot has no empty magazines, the instance goes straight back to the backing pool
+	void deallocateSlow(void* _ptr)
+	{
+		LockScope lk(m_lock);
+		m_pool.deallocate(_ptr);
+	}
+
+private:
+	Pool<Ty> m_pool;
+	Lock m_lock;                // Guards m_pool and m_caches
+	TlsData m_tls;
+
+	Magazine* m_magazines;
+	int32_t m_maxMagazines;
+	IndexStack m_fullMagazines;
+	IndexStack m_emptyMagazines;
+
+	Cache* m_caches;
 };
\ No newline at end of file
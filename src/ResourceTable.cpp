@@ -0,0 +1,250 @@
+#include <new>
+#include <string.h>
+
+#include "ResourceTable.hpp"
+
+bool ResourceTable::create(uint32_t capacity)
+{
+	if(!m_claims.create(RESOURCE_CLAIM_BUCKET_SIZE))
+		return false;
+	if(capacity == 0)
+		return true;
+
+	uint32_t numBuckets = 1;
+	while(numBuckets < capacity)
+		numBuckets <<= 1;
+
+	m_resources = new(std::nothrow) Resource[capacity];
+	m_buckets = new(std::nothrow) Bucket[numBuckets];
+	if(!m_resources || !m_buckets || !m_freeResources.create((int32_t)capacity, true))
+		return false;
+	for(uint32_t i = 0; i < numBuckets; i++)
+		m_buckets[i].first = -1;
+	m_mask = numBuckets - 1;
+	return true;
+}
+
+void ResourceTable::destroy()
+{
+	delete[] m_resources;
+	delete[] m_buckets;
+	m_resources = nullptr;
+	m_buckets = nullptr;
+	m_mask = 0;
+	m_freeResources.destroy();
+	m_claims.destroy();
+}
+
+// Takes a reference on the id's resource, adding it if nobody holds it. False if the table is full
+bool ResourceTable::acquire(uint32_t id, uint32_t* slot)
+{
+	if(!m_buckets)
+		return false;
+
+	Bucket* bucket = getBucket(id);
+	bucket->lock.lock();
+	int32_t i = bucket->first;
+	while(i >= 0 && m_resources[i].id != id)
+		i = m_resources[i].next;
+	if(i < 0)
+	{
+		i = m_freeResources.pop();
+		if(i >= 0)
+		{
+			Resource* resource = &m_resources[i];
+			resource->id = id;
+			resource->refs = 0;
+			resource->first = nullptr;
+			resource->last = nullptr;
+			resource->next = bucket->first;
+			bucket->first = i;
+		}
+	}
+	if(i >= 0)
+		m_resources[i].refs++;
+	bucket->lock.unlock();
+
+	if(i < 0)
+		return false;
+	*slot = (uint32_t)i;
+	return true;
+}
+
+// The last reference gives the resource back, its queue is empty then since every request holds one
+void ResourceTable::unref(uint32_t slot)
+{
+	Resource* resource = &m_resources[slot];
+	Bucket* bucket = getBucket(resource->id);
+	bucket->lock.lock();
+	if(--resource->refs == 0)
+	{
+		int32_t* link = &bucket->first;
+		while(*link != (int32_t)slot)
+			link = &m_resources[*link].next;
+		*link = resource->next;
+		m_freeResources.push((int32_t)slot);
+	}
+	bucket->lock.unlock();
+}
+
+ResourceClaim* ResourceTable::createClaim(Job* job, const ResourceAccess* resources, uint8_t numResources, bool cached)
+{
+	ResourceAccess distinct[MAX_JOB_RESOURCES];
+	uint8_t count = 0;
+	for(uint8_t i = 0; i < numResources; i++)
+	{
+		if(resources[i].id == 0)
+			continue;
+
+		uint8_t k = 0;
+		while(k < count && distinct[k].id != resources[i].id)
+			k++;
+		if(k < count)
+		{
+			distinct[k].write = distinct[k].write || resources[i].write;
+			continue;
+		}
+		if(count == MAX_JOB_RESOURCES)
+			return nullptr;
+		distinct[count++] = resources[i];
+	}
+
+	ResourceClaim* claim = cached ? m_claims.newInstance() : m_claims.newInstanceUncached();
+	if(!claim)
+		return nullptr;
+
+	claim->job = job;
+	claim->nextReady = nullptr;
+	claim->numRequests = 0;
+	for(uint8_t i = 0; i < count; i++)
+	{
+		uint32_t slot;
+		if(!acquire(distinct[i].id, &slot))
+		{
+			deleteClaim(claim, cached);
+			return nullptr;
+		}
+
+		// Ascending slot
+		uint8_t k = claim->numRequests;
+		for(; k > 0 && claim->requests[k - 1].slot > slot; k--)
+			claim->requests[k] = claim->requests[k - 1];
+
+		ResourceRequest* request = &claim->requests[k];
+		request->next = nullptr;
+		request->claim = claim;
+		request->slot = slot;
+		request->write = distinct[i].write;
+		request->granted = false;
+		claim->numRequests++;
+	}
+	claim->pending = claim->numRequests;
+	return claim;
+}
+
+void ResourceTable::deleteClaim(ResourceClaim* claim, bool cached)
+{
+	for(uint8_t i = 0; i < claim->numRequests; i++)
+		unref(claim->requests[i].slot);
+	if(cached)
+		m_claims.deleteInstance(claim);
+	else
+		m_claims.deallocateUncached(claim);
+}
+
+bool ResourceTable::enqueue(ResourceClaim* claim)
+{
+	// Holding every lock at once, two claims on the same resources line up the same way on each
+	for(uint8_t i = 0; i < claim->numRequests; i++)
+		m_resources[claim->requests[i].slot].lock.lock();
+
+	int32_t granted = 0;
+	for(uint8_t i = 0; i < claim->numRequests; i++)
+	{
+		ResourceRequest* request = &claim->requests[i];
+		Resource* resource = &m_resources[request->slot];
+
+		// A granted reader last means only granted readers are ahead
+		if(!resource->first)
+			request->granted = true;
+		else
+			request->granted = !request->write && !resource->last->write && resource->last->granted;
+		if(request->granted)
+			granted++;
+
+		if(resource->last)
+			resource->last->next = request;
+		else
+			resource->first = request;
+		resource->last = request;
+	}
+
+	for(uint8_t i = claim->numRequests; i > 0; i--)
+		m_resources[claim->requests[i - 1].slot].lock.unlock();
+
+	// Releases may grant the rest meanwhile, whoever takes the last one queues the job
+	return atomicFetchAndSub(&claim->pending, granted) == granted;
+}
+
+// Grants what the front of the queue allows now, a writer alone or the readers up to the next
+// writer. Caller holds the resource's lock
+void ResourceTable::grant(Resource* resource, ResourceClaim** ready)
+{
+	for(ResourceRequest* request = resource->first; request; request = request->next)
+	{
+		if(request->write && request != resource->first)
+			break;
+
+		if(!request->granted)
+		{
+			request->granted = true;
+			ResourceClaim* claim = request->claim;
+			if(atomicFetchAndSub(&claim->pending, 1) == 1)
+			{
+				claim->nextReady = *ready;
+				*ready = claim;
+			}
+		}
+
+		if(request->write)
+			break;
+	}
+}
+
+ResourceClaim* ResourceTable::release(ResourceClaim* claim)
+{
+	ResourceClaim* ready = nullptr;
+	for(uint8_t i = 0; i < claim->numRequests; i++)
+	{
+		ResourceRequest* request = &claim->requests[i];
+		Resource* resource = &m_resources[request->slot];
+		resource->lock.lock();
+
+		// It's among the granted ones at the front
+		ResourceRequest* prev = nullptr;
+		for(ResourceRequest* r = resource->first; r != request; r = r->next)
+			prev = r;
+		if(prev)
+			prev->next = request->next;
+		else
+			resource->first = request->next;
+		if(resource->last == request)
+			resource->last = prev;
+
+		grant(resource, &ready);
+		resource->lock.unlock();
+		unref(request->slot);
+	}
+	m_claims.deleteInstance(claim);
+
+	// Back to submission order, at least per resource
+	ResourceClaim* ordered = nullptr;
+	while(ready)
+	{
+		ResourceClaim* next = ready->nextReady;
+		ready->nextReady = ordered;
+		ordered = ready;
+		ready = next;
+	}
+	return ordered;
+}
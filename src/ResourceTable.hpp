@@ -0,0 +1,123 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "IndexStack.hpp"
+#include "Lock.hpp"
+#include "Pool.hpp"
+
+#define MAX_JOB_RESOURCES 8             // Resources one job may declare
+#define RESOURCE_CLAIM_BUCKET_SIZE 64
+
+struct Job;
+struct ResourceClaim;
+
+// A resource a job reads or writes, see JobDesc::resources. Ids are the caller's, 0 is none
+struct ResourceAccess
+{
+	uint32_t id;
+	bool write;
+
+	ResourceAccess()
+	{
+		id = 0;
+		write = false;
+	}
+
+	explicit ResourceAccess(uint32_t _id, bool _write = false)
+	{
+		id = _id;
+		write = _write;
+	}
+};
+
+// A job's place in the queue of one of its resources
+struct ResourceRequest
+{
+	ResourceRequest* next;
+	ResourceClaim* claim;
+	uint32_t slot;      // In the table
+	bool write;
+	bool granted;
+};
+
+// The resources a job declared, it may start once every request was granted
+struct ResourceClaim
+{
+	Job* job;
+	ResourceClaim* nextReady;       // Jobs a release let go, see ResourceTable::release
+	volatile int32_t pending;       // Requests not granted yet
+	uint8_t numRequests;
+	ResourceRequest requests[MAX_JOB_RESOURCES];    // Ascending slot, the order their locks are taken in
+};
+
+// Per resource reader/writer queues in submission order. A request is granted once only reads
+// are ahead of it, or nothing for a write, so readers share and writers go one at a time
+// A resource is in the table while claims hold it, found through hash buckets with a lock each
+// and its queue under its own. It goes back once the last claim on it is gone, so capacity
+// limits the resources declared at once, not the ids ever seen
+class ResourceTable
+{
+private:
+	struct Resource
+	{
+		uint32_t id;
+		int32_t refs;       // Claims holding a request on it, under the bucket's lock
+		int32_t next;       // In the bucket's chain, -1 at the end
+		SpinLock lock;
+		ResourceRequest* first;     // Submission order, the granted ones at the front
+		ResourceRequest* last;
+	};
+
+	struct Bucket
+	{
+		SpinLock lock;
+		int32_t first;
+	};
+
+	Resource* m_resources;
+	Bucket* m_buckets;
+	uint32_t m_mask;
+	IndexStack m_freeResources;
+	ConcurrentPool<ResourceClaim> m_claims;
+
+	inline Bucket* getBucket(uint32_t id)
+	{
+		return &m_buckets[(id*2654435761u) & m_mask];
+	}
+
+	bool acquire(uint32_t id, uint32_t* slot);
+	void unref(uint32_t slot);
+	void grant(Resource* resource, ResourceClaim** ready);
+
+public:
+	ResourceTable()
+	{
+		m_resources = nullptr;
+		m_buckets = nullptr;
+		m_mask = 0;
+	}
+
+	// Resources declared at once at most, 0 leaves the table empty and every claim fails
+	bool create(uint32_t capacity);
+	void destroy();
+	void flushCache()
+	{
+		m_claims.flushCache();
+	}
+
+	// The job's requests, deduplicated with writes winning. Null if there are too many, the table
+	// is full or out of memory, nothing is held then. cached as for ConcurrentPool::newInstance, else uncached
+	ResourceClaim* createClaim(Job* job, const ResourceAccess* resources, uint8_t numResources, bool cached);
+
+	// Lets go of a claim that was never queued, cached as it was created
+	void deleteClaim(ResourceClaim* claim, bool cached);
+
+	// Queues the claim behind everything declared on its resources before, in one step over all of
+	// them. True if it got them all right away, else its job comes out of a later release
+	bool enqueue(ResourceClaim* claim);
+
+	// Gives the job's resources back and frees the claim. Returns the claims that got their last
+	// request granted, linked by nextReady, their jobs may start
+	ResourceClaim* release(ResourceClaim* claim);
+};
@@ -0,0 +1,434 @@
+#pragma once
+
+#include <stdint.h>
+#include <malloc.h>
+#include <new>
+
+#include "Lock.hpp"
+
+#define RING_CACHE_LINE 64
+
+#define QUEUE_BLOCK_SIZE 31     // Slots per MpmcQueue block, one index per lap is left for the block switch
+
+// Bounded lock-free multi-producer multi-consumer queue (Vyukov)
+// Every cell carries a sequence number telling whose turn it is: pos when it's free for the push
+// at pos, pos + 1 once that push is published. Push and pop only race on their own position,
+// and a full or empty ring is detected without touching the other side's counter
+template <typename Ty>
+class MpmcRing
+{
+public:
+	MpmcRing()
+	{
+		m_cells = nullptr;
+		m_mask = 0;
+		m_enqueuePos = 0;
+		m_dequeuePos = 0;
+	}
+
+	// Capacity is rounded up to a power of two
+	bool create(uint32_t _capacity)
+	{
+		// One cell can't tell a full ring from a free one, the sequences would match
+		uint32_t capacity = 2;
+		while(capacity < _capacity)
+			capacity <<= 1;
+
+		m_cells = (Cell*)malloc(sizeof(Cell)*capacity);
+		if(!m_cells)
+			return false;
+
+		for(uint32_t i = 0; i < capacity; i++)
+		{
+			new(&m_cells[i].data) Ty();
+			m_cells[i].sequence = (int32_t)i;
+		}
+		m_mask = capacity - 1;
+		m_enqueuePos = 0;
+		m_dequeuePos = 0;
+		return true;
+	}
+
+	void destroy()
+	{
+		if(m_cells)
+		{
+			for(uint32_t i = 0; i <= m_mask; i++)
+				m_cells[i].data.~Ty();
+			free(m_cells);
+			m_cells = nullptr;
+		}
+		m_mask = 0;
+	}
+
+	// Returns false if the ring is full
+	bool push(const Ty& _value)
+	{
+		int32_t pos = atomicLoadAcquire(&m_enqueuePos);
+		Cell* cell;
+		for(;;)
+		{
+			cell = &m_cells[(uint32_t)pos & m_mask];
+			int32_t dif = diff(atomicLoadAcquire(&cell->sequence), pos);
+			if(dif == 0)
+			{
+				int32_t prev = atomicCompareAndSwap(&m_enqueuePos, pos, advance(pos, 1));
+				if(prev == pos)
+					break;
+				pos = prev;
+			}
+			else if(dif < 0)
+			{
+				return false;
+			}
+			else
+			{
+				pos = atomicLoadAcquire(&m_enqueuePos);
+			}
+		}
+
+		cell->data = _value;
+		atomicStoreRelease(&cell->sequence, advance(pos, 1));
+		return true;
+	}
+
+	// Returns false if the ring is empty, or the next push isn't published yet
+	bool pop(Ty* _value)
+	{
+		int32_t pos = atomicLoadAcquire(&m_dequeuePos);
+		Cell* cell;
+		for(;;)
+		{
+			cell = &m_cells[(uint32_t)pos & m_mask];
+			int32_t dif = diff(atomicLoadAcquire(&cell->sequence), advance(pos, 1));
+			if(dif == 0)
+			{
+				int32_t prev = atomicCompareAndSwap(&m_dequeuePos, pos, advance(pos, 1));
+				if(prev == pos)
+					break;
+				pos = prev;
+			}
+			else if(dif < 0)
+			{
+				return false;
+			}
+			else
+			{
+				pos = atomicLoadAcquire(&m_dequeuePos);
+			}
+		}
+
+		*_value = cell->data;
+		atomicStoreRelease(&cell->sequence, advance(pos, m_mask + 1));
+		return true;
+	}
+
+	// Snapshot, it can be out of date by the time it returns
+	bool isEmpty() const
+	{
+		return atomicLoadAcquire(&m_enqueuePos) == atomicLoadAcquire(&m_dequeuePos);
+	}
+
+	bool isFull() const
+	{
+		return diff(atomicLoadAcquire(&m_enqueuePos), atomicLoadAcquire(&m_dequeuePos)) >= (int32_t)(m_mask + 1);
+	}
+
+	uint32_t getCapacity() const
+	{
+		return m_mask + 1;
+	}
+
+private:
+	// Positions wrap around, all arithmetic on them is unsigned
+	static int32_t advance(int32_t _pos, uint32_t _count)
+	{
+		return (int32_t)((uint32_t)_pos + _count);
+	}
+
+	static int32_t diff(int32_t _a, int32_t _b)
+	{
+		return (int32_t)((uint32_t)_a - (uint32_t)_b);
+	}
+
+	struct Cell
+	{
+		volatile int32_t sequence;
+		Ty data;
+	};
+
+	Cell* m_cells;
+	uint32_t m_mask;
+	uint8_t m_pad0[RING_CACHE_LINE];    // Producers and consumers don't share a line
+	volatile int32_t m_enqueuePos;
+	uint8_t m_pad1[RING_CACHE_LINE];
+	volatile int32_t m_dequeuePos;
+};
+
+// Unbounded lock-free multi-producer multi-consumer queue, a linked list of fixed blocks
+// Indices count in steps of two, bit 0 of the head index tells the head block has a successor.
+// An index at offset QUEUE_BLOCK_SIZE in its lap means the next block is being installed. Every
+// slot has WRITE/READ/DESTROY state bits, the reader of the last slot frees the block, or the
+// last reader still in it once the DESTROY bits reached it
+template <typename Ty>
+class MpmcQueue
+{
+public:
+	MpmcQueue()
+	{
+		m_headIndex = 0;
+		m_headBlock = nullptr;
+		m_tailIndex = 0;
+		m_tailBlock = nullptr;
+	}
+
+	~MpmcQueue()
+	{
+		destroy();
+	}
+
+	// Frees the remaining items, nobody may use the queue anymore
+	void destroy()
+	{
+		uint32_t head = (uint32_t)m_headIndex & ~(uint32_t)HasNext;
+		uint32_t tail = (uint32_t)m_tailIndex & ~(uint32_t)HasNext;
+		Block* block = m_headBlock;
+		while(head != tail)
+		{
+			if(((head >> Shift) % Lap) == QUEUE_BLOCK_SIZE)
+			{
+				Block* next = block->next;
+				delete block;
+				block = next;
+			}
+			head += 1 << Shift;
+		}
+		delete block;
+
+		m_headIndex = 0;
+		m_headBlock = nullptr;
+		m_tailIndex = 0;
+		m_tailBlock = nullptr;
+	}
+
+	// Returns false only if a block couldn't be allocated
+	bool push(const Ty& _value)
+	{
+		uint32_t tail = (uint32_t)atomicLoadAcquire(&m_tailIndex);
+		Block* block = loadBlock(&m_tailBlock);
+		Block* next = nullptr;
+		for(;;)
+		{
+			uint32_t offset = (tail >> Shift) % Lap;
+			if(offset == QUEUE_BLOCK_SIZE)
+			{
+				// Another push is installing the next block
+				Thread::yield();
+				tail = (uint32_t)atomicLoadAcquire(&m_tailIndex);
+				block = loadBlock(&m_tailBlock);
+				continue;
+			}
+
+			// Allocated up front, so the block switch after the CAS can't fail
+			if(offset + 1 == QUEUE_BLOCK_SIZE && !next)
+			{
+				next = new(std::nothrow) Block();
+				if(!next)
+					return false;
+			}
+
+			if(!block)
+			{
+				// First push ever
+				Block* first = new(std::nothrow) Block();
+				if(!first)
+				{
+					delete next;
+					return false;
+				}
+
+				if(atomicCompareAndSwapPtr((void* volatile*)&m_tailBlock, nullptr, first) == nullptr)
+				{
+					atomicStoreReleasePtr((void* volatile*)&m_headBlock, first);
+					block = first;
+				}
+				else
+				{
+					delete next;
+					next = first;
+					tail = (uint32_t)atomicLoadAcquire(&m_tailIndex);
+					block = loadBlock(&m_tailBlock);
+					continue;
+				}
+			}
+
+			uint32_t newTail = tail + (1 << Shift);
+			uint32_t prev = (uint32_t)atomicCompareAndSwap(&m_tailIndex, (int32_t)tail, (int32_t)newTail);
+			if(prev != tail)
+			{
+				tail = prev;
+				block = loadBlock(&m_tailBlock);
+				continue;
+			}
+
+			if(offset + 1 == QUEUE_BLOCK_SIZE)
+			{
+				// Took the last slot, move the tail on to the next block
+				atomicStoreReleasePtr((void* volatile*)&m_tailBlock, next);
+				atomicStoreRelease(&m_tailIndex, (int32_t)(newTail + (1 << Shift)));
+				atomicStoreReleasePtr((void* volatile*)&block->next, next);
+				next = nullptr;
+			}
+			delete next;
+
+			Slot& slot = block->slots[offset];
+			slot.value = _value;
+			atomicFetchAndOr(&slot.state, Write);
+			return true;
+		}
+	}
+
+	// Returns false if the queue is empty
+	bool pop(Ty* _value)
+	{
+		uint32_t head = (uint32_t)atomicLoadAcquire(&m_headIndex);
+		Block* block = loadBlock(&m_headBlock);
+		for(;;)
+		{
+			uint32_t offset = (head >> Shift) % Lap;
+			if(offset == QUEUE_BLOCK_SIZE)
+			{
+				// Another pop is moving the head to the next block
+				Thread::yield();
+				head = (uint32_t)atomicLoadAcquire(&m_headIndex);
+				block = loadBlock(&m_headBlock);
+				continue;
+			}
+
+			uint32_t newHead = head + (1 << Shift);
+			if(!(newHead & HasNext))
+			{
+				atomicFence();
+				uint32_t tail = (uint32_t)m_tailIndex;
+				if((head >> Shift) == (tail >> Shift))
+					return false;
+
+				// Tail is in a later block, this one is followed for sure
+				if((head >> Shift)/Lap != (tail >> Shift)/Lap)
+					newHead |= HasNext;
+			}
+
+			if(!block)
+			{
+				// The first push hasn't published the block yet
+				Thread::yield();
+				head = (uint32_t)atomicLoadAcquire(&m_headIndex);
+				block = loadBlock(&m_headBlock);
+				continue;
+			}
+
+			uint32_t prev = (uint32_t)atomicCompareAndSwap(&m_headIndex, (int32_t)head, (int32_t)newHead);
+			if(prev != head)
+			{
+				head = prev;
+				block = loadBlock(&m_headBlock);
+				continue;
+			}
+
+			if(offset + 1 == QUEUE_BLOCK_SIZE)
+			{
+				// Took the last slot, move the head on to the next block
+				Block* next = waitNext(block);
+				uint32_t nextIndex = (newHead & ~(uint32_t)HasNext) + (1 << Shift);
+				if(loadBlock(&next->next))
+					nextIndex |= HasNext;
+				atomicStoreReleasePtr((void* volatile*)&m_headBlock, next);
+				atomicStoreRelease(&m_headIndex, (int32_t)nextIndex);
+			}
+
+			Slot& slot = block->slots[offset];
+			while(!(atomicLoadAcquire(&slot.state) & Write))
+				Thread::yield();
+			*_value = slot.value;
+
+			if(offset + 1 == QUEUE_BLOCK_SIZE)
+				destroyBlock(block, 0);
+			else if(atomicFetchAndOr(&slot.state, Read) & Destroy)
+				destroyBlock(block, offset + 1);
+			return true;
+		}
+	}
+
+	// Snapshot, it can be out of date by the time it returns
+	bool isEmpty() const
+	{
+		return ((uint32_t)atomicLoadAcquire(&m_headIndex) >> Shift) == ((uint32_t)atomicLoadAcquire(&m_tailIndex) >> Shift);
+	}
+
+private:
+	enum
+	{
+		Shift = 1,
+		Lap = QUEUE_BLOCK_SIZE + 1,
+		HasNext = 1,
+
+		Write = 1,
+		Read = 2,
+		Destroy = 4,
+	};
+
+	struct Slot
+	{
+		Ty value;
+		volatile int32_t state;
+
+		Slot(): value(), state(0)
+		{
+		}
+	};
+
+	struct Block
+	{
+		Block* volatile next;
+		Slot slots[QUEUE_BLOCK_SIZE];
+
+		Block(): next(nullptr)
+		{
+		}
+	};
+
+	static Block* loadBlock(Block* const volatile* _ptr)
+	{
+		return (Block*)atomicLoadAcquirePtr((void* const volatile*)_ptr);
+	}
+
+	static Block* waitNext(Block* _block)
+	{
+		for(;;)
+		{
+			Block* next = loadBlock(&_block->next);
+			if(next)
+				return next;
+			Thread::yield();
+		}
+	}
+
+	// Frees the block once every slot from start on is read. A slot still being read gets
+	// DESTROY set instead and its reader carries on from there. The last slot started this
+	static void destroyBlock(Block* _block, uint32_t _start)
+	{
+		for(uint32_t i = _start; i < QUEUE_BLOCK_SIZE - 1; i++)
+		{
+			Slot& slot = _block->slots[i];
+			if(!(atomicLoadAcquire(&slot.state) & Read) && !(atomicFetchAndOr(&slot.state, Destroy) & Read))
+				return;
+		}
+		delete _block;
+	}
+
+	volatile int32_t m_headIndex;
+	Block* volatile m_headBlock;
+	uint8_t m_pad[RING_CACHE_LINE];     // Producers and consumers don't share a line
+	volatile int32_t m_tailIndex;
+	Block* volatile m_tailBlock;
+};
@@ -0,0 +1,332 @@
+#include <string.h>
+
+#include "StackGuard.hpp"
+#include "JobDispatcher.hpp"
+
+#ifdef WALO_PLATFORM_POSIX
+#include <signal.h>
+#include <unistd.h>
+#endif
+
+extern JobDispatcherBase* volatile g_dispatchers[MAX_JOB_DISPATCHERS];
+
+StackProfile::StackProfile()
+{
+	memset(m_entries, 0x00, sizeof(m_entries));
+}
+
+uint32_t StackProfile::hash(JobCallback callback)
+{
+	uint64_t h = (uint64_t)(uintptr_t)callback;
+	h ^= h >> 17;
+	h *= 0x9E3779B97F4A7C15ull;
+	return (uint32_t)(h >> 32) & (MAX_STACK_PROFILE_ENTRIES - 1);
+}
+
+void StackProfile::record(JobCallback callback, uint32_t usedBytes, uint32_t stackSize)
+{
+	uint32_t idx = hash(callback);
+	for(int i = 0; i < MAX_STACK_PROFILE_ENTRIES; i++)
+	{
+		Entry& e = m_entries[idx];
+		void* key = e.callback;
+		if(!key)
+			key = atomicCompareAndSwapPtr(&e.callback, nullptr, (void*)callback);
+
+		// Either we just claimed it (key == null) or it already was ours
+		if(!key || key == (void*)callback)
+		{
+			atomicMax(&e.peak, (int32_t)usedBytes);
+			atomicMax(&e.stackSize, (int32_t)stackSize);
+			atomicFetchAndAdd(&e.numJobs, 1);
+			return;
+		}
+
+		idx = (idx + 1) & (MAX_STACK_PROFILE_ENTRIES - 1);
+	}
+
+	// Table is full, this callback goes unmeasured
+}
+
+uint32_t StackProfile::getPeak(JobCallback callback) const
+{
+	uint32_t idx = hash(callback);
+	for(int i = 0; i < MAX_STACK_PROFILE_ENTRIES; i++)
+	{
+		const Entry& e = m_entries[idx];
+		if(!e.callback)
+			return 0;
+		if(e.callback == (void*)callback)
+			return (uint32_t)e.peak;
+		idx = (idx + 1) & (MAX_STACK_PROFILE_ENTRIES - 1);
+	}
+	return 0;
+}
+
+int StackProfile::getUsage(JobStackUsage* usage, int maxCount) const
+{
+	int count = 0;
+	for(int i = 0; i < MAX_STACK_PROFILE_ENTRIES && count < maxCount; i++)
+	{
+		const Entry& e = m_entries[i];
+		if(!e.callback || e.numJobs == 0)
+			continue;
+		usage[count].callback = (JobCallback)e.callback;
+		usage[count].peakBytes = (uint32_t)e.peak;
+		usage[count].stackSize = (uint32_t)e.stackSize;
+		usage[count].numJobs = (uint32_t)e.numJobs;
+		count++;
+	}
+	return count;
+}
+
+static size_t getGuardSize()
+{
+	static size_t guardSize = get_fcontext_guard_size();
+	return guardSize;
+}
+
+void paintStack(const fcontext_stack_t& stack)
+{
+	uint32_t* bottom = (uint32_t*)((uint8_t*)stack.sptr - stack.ssize + getGuardSize());
+	uint32_t* top = (uint32_t*)stack.sptr;
+	for(uint32_t* p = bottom; p < top; p++)
+		*p = STACK_PAINT_PATTERN;
+}
+
+uint32_t measureStack(const fcontext_stack_t& stack)
+{
+	uint32_t* bottom = (uint32_t*)((uint8_t*)stack.sptr - stack.ssize + getGuardSize());
+	uint32_t* top = (uint32_t*)stack.sptr;
+
+	// Stacks grow down, the first overwritten word from the bottom is the high-water mark
+	uint32_t* p = bottom;
+	while(p < top && *p == STACK_PAINT_PATTERN)
+		p++;
+	uint32_t used = (uint32_t)((uint8_t*)top - (uint8_t*)p);
+
+	// Repaint only what was touched
+	for(uint32_t* q = p; q < top; q++)
+		*q = STACK_PAINT_PATTERN;
+
+	return used;
+}
+
+// Fault reporting, only async-signal-safe calls from here on
+struct FaultMessage
+{
+	char text[512];
+	size_t len;
+
+	FaultMessage()
+	{
+		len = 0;
+	}
+
+	void append(const char* str)
+	{
+		while(*str && len < sizeof(text))
+			text[len++] = *str++;
+	}
+
+	void appendHex(uintptr_t value)
+	{
+		char buff[2 + sizeof(uintptr_t)*2 + 1];
+		int n = sizeof(buff) - 1;
+		buff[n] = 0;
+		do
+		{
+			buff[--n] = "0123456789abcdef"[value & 0xf];
+			value >>= 4;
+		} while(value && n > 2);
+		buff[--n] = 'x';
+		buff[--n] = '0';
+		append(buff + n);
+	}
+
+	void appendDec(uint32_t value)
+	{
+		char buff[11];
+		int n = sizeof(buff) - 1;
+		buff[n] = 0;
+		do
+		{
+			buff[--n] = (char)('0' + value % 10);
+			value /= 10;
+		} while(value);
+		append(buff + n);
+	}
+};
+
+static void writeFaultMessage(const FaultMessage& msg)
+{
+#ifdef WALO_PLATFORM_WINDOWS
+	DWORD written;
+	WriteFile(GetStdHandle(STD_ERROR_HANDLE), msg.text, (DWORD)msg.len, &written, NULL);
+	OutputDebugStringA("walo: fiber stack overflow, see stderr\n");
+#elif defined(WALO_PLATFORM_POSIX)
+	ssize_t r = write(STDERR_FILENO, msg.text, msg.len);
+	(void)r;
+#endif
+}
+
+static bool reportFiberFault(const void* addr)
+{
+	for(int d = 0; d < MAX_JOB_DISPATCHERS; d++)
+	{
+		JobDispatcherBase* dispatcher = g_dispatchers[d];
+		if(!dispatcher)
+			continue;
+
+		for(uint8_t i = 0; i < dispatcher->numFiberPools; i++)
+		{
+			const FiberPool& pool = dispatcher->fiberPools[i];
+			Fiber* fiber = pool.findGuardFiber(addr);
+			if(!fiber)
+				continue;
+
+			FaultMessage msg;
+			msg.append("walo: fiber stack overflow in job callback ");
+			msg.appendHex((uintptr_t)fiber->job->callback);
+			msg.append(" (jobIndex ");
+			msg.appendDec(fiber->job->jobIndex);
+			msg.append(", userParam ");
+			msg.appendHex((uintptr_t)fiber->job->userData);
+			msg.append("), stack size ");
+			msg.appendDec(pool.getStackSize());
+			msg.append(", fault address ");
+			msg.appendHex((uintptr_t)addr);
+			msg.append("\n");
+			writeFaultMessage(msg);
+			return true;
+		}
+	}
+	return false;
+}
+
+#ifdef WALO_PLATFORM_POSIX
+static struct sigaction s_prevSegv;
+static struct sigaction s_prevBus;
+static int s_installCount = 0;
+
+static void faultHandler(int sig, siginfo_t* info, void* ucontext)
+{
+	struct sigaction* prev = (sig == SIGSEGV) ? &s_prevSegv : &s_prevBus;
+
+	if(!reportFiberFault(info->si_addr) && (prev->sa_flags & SA_SIGINFO) && prev->sa_sigaction)
+	{
+		// Not ours, chain to whoever was installed before
+		prev->sa_sigaction(sig, info, ucontext);
+		return;
+	}
+
+	// Put back the previous handler and return, the faulting instruction runs again and crashes through it
+	sigaction(sig, prev, nullptr);
+}
+
+bool installStackGuard()
+{
+	if(s_installCount > 0)
+	{
+		s_installCount++;
+		return true;
+	}
+
+	struct sigaction sa;
+	memset(&sa, 0x00, sizeof(sa));
+	sa.sa_sigaction = faultHandler;
+	sa.sa_flags = SA_SIGINFO | SA_ONSTACK;
+	sigemptyset(&sa.sa_mask);
+
+	if(sigaction(SIGSEGV, &sa, &s_prevSegv) != 0)
+		return false;
+	if(sigaction(SIGBUS, &sa, &s_prevBus) != 0)
+	{
+		sigaction(SIGSEGV, &s_prevSegv, nullptr);
+		return false;
+	}
+
+	s_installCount = 1;
+	return true;
+}
+
+void uninstallStackGuard()
+{
+	if(s_installCount == 0 || --s_installCount > 0)
+		return;
+	sigaction(SIGSEGV, &s_prevSegv, nullptr);
+	sigaction(SIGBUS, &s_prevBus, nullptr);
+}
+
+void* createSignalStack()
+{
+	void* mem = malloc(SIGNAL_STACK_SIZE);
+	if(!mem)
+		return nullptr;
+
+	stack_t ss;
+	memset(&ss, 0x00, sizeof(ss));
+	ss.ss_sp = mem;
+	ss.ss_size = SIGNAL_STACK_SIZE;
+	if(sigaltstack(&ss, nullptr) != 0)
+	{
+		free(mem);
+		return nullptr;
+	}
+	return mem;
+}
+
+void destroySignalStack(void* stack)
+{
+	if(!stack)
+		return;
+
+	stack_t ss;
+	memset(&ss, 0x00, sizeof(ss));
+	ss.ss_flags = SS_DISABLE;
+	sigaltstack(&ss, nullptr);
+	free(stack);
+}
+#elif defined(WALO_PLATFORM_WINDOWS)
+static PVOID s_handler = NULL;
+static int s_installCount = 0;
+
+static LONG CALLBACK faultHandler(PEXCEPTION_POINTERS info)
+{
+	DWORD code = info->ExceptionRecord->ExceptionCode;
+	if((code == STATUS_GUARD_PAGE_VIOLATION || code == EXCEPTION_ACCESS_VIOLATION || code == EXCEPTION_STACK_OVERFLOW) &&
+		info->ExceptionRecord->NumberParameters >= 2)
+	{
+		reportFiberFault((const void*)info->ExceptionRecord->ExceptionInformation[1]);
+	}
+	return EXCEPTION_CONTINUE_SEARCH;
+}
+
+bool installStackGuard()
+{
+	if(!s_handler)
+		s_handler = AddVectoredExceptionHandler(1, faultHandler);
+	if(!s_handler)
+		return false;
+	s_installCount++;
+	return true;
+}
+
+void uninstallStackGuard()
+{
+	if(s_installCount == 0 || --s_installCount > 0)
+		return;
+	RemoveVectoredExceptionHandler(s_handler);
+	s_handler = NULL;
+}
+
+// Vectored handlers run on the faulting thread's stack, the tripped guard page leaves room for them
+void* createSignalStack()
+{
+	return nullptr;
+}
+
+void destroySignalStack(void* stack)
+{
+}
+#endif
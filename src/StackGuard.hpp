@@ -0,0 +1,63 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "Fiber.hpp"
+
+#define STACK_PAINT_PATTERN 0xCDCDCDCD
+#define MAX_STACK_PROFILE_ENTRIES 1024      // Distinct callbacks tracked, must be a power of two
+#define SIGNAL_STACK_SIZE 65536             // 64kb, per thread stack the fault handler runs on
+
+struct JobStackUsage
+{
+	JobCallback callback;
+	uint32_t peakBytes;     // Deepest stack use seen for this callback
+	uint32_t stackSize;     // Usable size of the largest stack it ran on
+	uint32_t numJobs;       // Number of measured runs
+};
+
+// Peak stack depth per callback, filled at job completion when stack painting is enabled
+// Open addressing table keyed by callback, entries are claimed and updated with CAS only
+class StackProfile
+{
+public:
+	StackProfile();
+
+	void record(JobCallback callback, uint32_t usedBytes, uint32_t stackSize);
+
+	// Returns 0 if the callback was never measured
+	uint32_t getPeak(JobCallback callback) const;
+
+	// Fills up to maxCount entries and returns the number written
+	int getUsage(JobStackUsage* usage, int maxCount) const;
+
+private:
+	struct Entry
+	{
+		void* volatile callback;
+		volatile int32_t peak;
+		volatile int32_t stackSize;
+		volatile int32_t numJobs;
+	};
+
+	static uint32_t hash(JobCallback callback);
+
+	Entry m_entries[MAX_STACK_PROFILE_ENTRIES];
+};
+
+// Fills the usable part of the stack (above the guard page) with STACK_PAINT_PATTERN
+void paintStack(const fcontext_stack_t& stack);
+
+// Returns the number of bytes touched since the last paint and repaints them
+// Must not be called on the stack being measured
+uint32_t measureStack(const fcontext_stack_t& stack);
+
+// Process-wide SIGSEGV/SIGBUS (vectored exception on Windows) handler that maps a fault inside
+// a fiber guard page back to its fiber and reports the job, then lets the crash go on as usual
+// Reference counted, one install per dispatcher, callers serialize install/uninstall
+bool installStackGuard();
+void uninstallStackGuard();
+
+// Alternate signal stack for the calling thread, an overflowed stack can't run the handler itself
+void* createSignalStack();
+void destroySignalStack(void* stack);
@@ -0,0 +1,140 @@
+#include <stdio.h>
+
+#include "fcontext.h"
+#include "Platform.hpp"
+#include "Thread.hpp"
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#include <xmmintrin.h>
+#define SWITCH_BENCH_FP_X86
+#elif defined(__aarch64__) && defined(WALO_COMPILER_GCC)
+#define SWITCH_BENCH_FP_ARM64
+#endif
+
+// Ping-pong between the calling thread and a partner context that switches straight back, the
+// cost of the switches our fibers use against one that also carries the FPU control state like
+// stock Boost.Context does. The fcontext entry points leave that state to the thread
+
+#define SWITCH_STACK_SIZE 65536
+
+#if defined(SWITCH_BENCH_FP_X86)
+struct FpControl
+{
+	uint32_t mxcsr;
+	uint16_t x87cw;
+};
+
+static inline void saveFpControl(FpControl* fp)
+{
+	fp->mxcsr = _mm_getcsr();
+#ifdef WALO_COMPILER_GCC
+	__asm__ __volatile__("fnstcw %0" : "=m"(fp->x87cw));
+#endif
+}
+
+static inline void loadFpControl(const FpControl* fp)
+{
+	_mm_setcsr(fp->mxcsr);
+#ifdef WALO_COMPILER_GCC
+	__asm__ __volatile__("fldcw %0" : : "m"(fp->x87cw));
+#endif
+}
+#elif defined(SWITCH_BENCH_FP_ARM64)
+struct FpControl
+{
+	uint64_t fpcr;
+};
+
+static inline void saveFpControl(FpControl* fp)
+{
+	__asm__ __volatile__("mrs %0, fpcr" : "=r"(fp->fpcr));
+}
+
+static inline void loadFpControl(const FpControl* fp)
+{
+	__asm__ __volatile__("msr fpcr, %0" : : "r"(fp->fpcr));
+}
+#endif
+
+#if defined(SWITCH_BENCH_FP_X86) || defined(SWITCH_BENCH_FP_ARM64)
+// What the full-state switch does around the register swap
+static inline fcontext_transfer_t jumpWithFpControl(fcontext_t const to, void* vp)
+{
+	FpControl fp;
+	saveFpControl(&fp);
+	fcontext_transfer_t transfer = jump_fcontext(to, vp);
+	loadFpControl(&fp);
+	return transfer;
+}
+
+static void fpPartner(fcontext_transfer_t transfer)
+{
+	for(;;)
+		transfer = jumpWithFpControl(transfer.ctx, transfer.data);
+}
+#endif
+
+static void jumpPartner(fcontext_transfer_t transfer)
+{
+	for(;;)
+		transfer = jump_fcontext(transfer.ctx, transfer.data);
+}
+
+static fcontext_transfer_t ontopHook(fcontext_transfer_t transfer)
+{
+	return transfer;
+}
+
+// Nanoseconds per switch, a round trip is two of them
+static double toNsPerSwitch(int64_t ticks, uint32_t numRoundTrips)
+{
+	return 1000000000.0*(double)ticks/(double)getHPFrequency()/(2.0*numRoundTrips);
+}
+
+int runSwitchBenchmarks(uint32_t numRoundTrips)
+{
+	if(numRoundTrips == 0)
+		numRoundTrips = 1;
+
+	fcontext_stack_t stack = create_fcontext_stack(SWITCH_STACK_SIZE);
+	if(!stack.sptr)
+	{
+		printf("no stack\n");
+		return 1;
+	}
+
+	// Every run starts the partner fresh, the previous one is simply left behind on the stack
+	fcontext_t partner = make_fcontext(stack.sptr, stack.ssize, jumpPartner);
+	fcontext_transfer_t transfer = jump_fcontext(partner, nullptr);
+	int64_t t0 = getHPCounter();
+	for(uint32_t i = 0; i < numRoundTrips; i++)
+		transfer = jump_fcontext(transfer.ctx, nullptr);
+	int64_t jumpTicks = getHPCounter() - t0;
+
+	// The hook runs on the partner's stack, then the partner returns from its jump and comes back
+	partner = make_fcontext(stack.sptr, stack.ssize, jumpPartner);
+	transfer = jump_fcontext(partner, nullptr);
+	t0 = getHPCounter();
+	for(uint32_t i = 0; i < numRoundTrips; i++)
+		transfer = ontop_fcontext(transfer.ctx, nullptr, ontopHook);
+	int64_t ontopTicks = getHPCounter() - t0;
+
+	printf("%-20s %10s %10s\n", "switch", "total ms", "ns/switch");
+	printf("%-20s %10.2f %10.2f\n", "jump", 1000.0*jumpTicks/getHPFrequency(), toNsPerSwitch(jumpTicks, numRoundTrips));
+	printf("%-20s %10.2f %10.2f\n", "ontop + jump", 1000.0*ontopTicks/getHPFrequency(), toNsPerSwitch(ontopTicks, numRoundTrips));
+
+#if defined(SWITCH_BENCH_FP_X86) || defined(SWITCH_BENCH_FP_ARM64)
+	partner = make_fcontext(stack.sptr, stack.ssize, fpPartner);
+	transfer = jumpWithFpControl(partner, nullptr);
+	t0 = getHPCounter();
+	for(uint32_t i = 0; i < numRoundTrips; i++)
+		transfer = jumpWithFpControl(transfer.ctx, nullptr);
+	int64_t fpTicks = getHPCounter() - t0;
+
+	printf("%-20s %10.2f %10.2f\n", "jump + fp control", 1000.0*fpTicks/getHPFrequency(), toNsPerSwitch(fpTicks, numRoundTrips));
+	printf("fp control adds %.1f%% to a jump\n", 100.0*((double)fpTicks/(double)jumpTicks - 1.0));
+#endif
+
+	destroy_fcontext_stack(&stack);
+	return 0;
+}
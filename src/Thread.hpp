@@ -4,6 +4,13 @@
 
 #ifndef WALO_PLATFORM_WINDOWS
 #include <pthread.h>
+#include <time.h>
+#if defined(__linux__)
+#include <sched.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#endif
 #else
 #include <Windows.h>
 #endif
@@ -12,6 +19,43 @@
 
 typedef int32_t(*ThreadFn)(void* _userData);
 
+struct ThreadPriority
+{
+	enum Enum
+	{
+		Lowest = 0,
+		BelowNormal,
+		Normal,
+		AboveNormal,
+		Highest
+	};
+};
+
+// Monotonic high resolution clock
+inline int64_t getHPCounter()
+{
+#ifdef WALO_PLATFORM_WINDOWS
+	LARGE_INTEGER counter;
+	QueryPerformanceCounter(&counter);
+	return counter.QuadPart;
+#else
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (int64_t)now.tv_sec*1000000000 + now.tv_nsec;
+#endif
+}
+
+inline int64_t getHPFrequency()
+{
+#ifdef WALO_PLATFORM_WINDOWS
+	LARGE_INTEGER frequency;
+	QueryPerformanceFrequency(&frequency);
+	return frequency.QuadPart;
+#else
+	return 1000000000;
+#endif
+}
+
 class Semaphore
 {
 public:
@@ -23,6 +67,7 @@ public:
 		int result;
 		result = pthread_mutex_init(&m_mutex, NULL);
 		result = pthread_cond_init(&m_cond, NULL);
+		m_count = 0;
 #endif
 	}
 
@@ -73,15 +118,34 @@ public:
 		}
 		else
 		{
+#if defined(__APPLE__)
 			timespec ts;
 			ts.tv_sec = _msecs / 1000;
-			ts.tv_nsec = (_msecs % 1000) * 1000;
+			ts.tv_nsec = (_msecs % 1000) * 1000000;
 
 			while(0 == result
 				&& 0 >= m_count)
 			{
 				result = pthread_cond_timedwait_relative_np(&m_cond, &m_mutex, &ts);
 			}
+#else
+			// Absolute deadline, so spurious wakeups don't extend the wait
+			timespec ts;
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_sec += _msecs / 1000;
+			ts.tv_nsec += (_msecs % 1000) * 1000000;
+			if(ts.tv_nsec >= 1000000000)
+			{
+				ts.tv_sec++;
+				ts.tv_nsec -= 1000000000;
+			}
+
+			while(0 == result
+				&& 0 >= m_count)
+			{
+				result = pthread_cond_timedwait(&m_cond, &m_mutex, &ts);
+			}
+#endif
 		}
 
 		bool ok = 0 == result;
@@ -199,6 +263,42 @@ public:
 #endif
 	}
 
+	// Applies to the calling thread. On posix this is the thread's nice value, raising it above
+	// Normal usually needs privileges. Returns false if the OS refused or doesn't support it
+	static bool setPriority(ThreadPriority::Enum _priority)
+	{
+#ifdef WALO_PLATFORM_WINDOWS
+		static const int priorities[] = { THREAD_PRIORITY_LOWEST, THREAD_PRIORITY_BELOW_NORMAL, THREAD_PRIORITY_NORMAL, THREAD_PRIORITY_ABOVE_NORMAL, THREAD_PRIORITY_HIGHEST };
+		return ::SetThreadPriority(::GetCurrentThread(), priorities[_priority]) != 0;
+#elif defined(__linux__)
+		static const int nice[] = { 10, 5, 0, -5, -10 };
+		return ::setpriority(PRIO_PROCESS, (id_t)::syscall(SYS_gettid), nice[_priority]) == 0;
+#else
+		return _priority == ThreadPriority::Normal;
+#endif
+	}
+
+	// Restricts the calling thread to the CPUs set in _mask (bit n = CPU n), 0 leaves it alone
+	static bool setAffinity(uint64_t _mask)
+	{
+		if(0 == _mask)
+			return true;
+#ifdef WALO_PLATFORM_WINDOWS
+		return ::SetThreadAffinityMask(::GetCurrentThread(), (DWORD_PTR)_mask) != 0;
+#elif defined(__linux__)
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		for(int ii = 0; ii < 64; ++ii)
+		{
+			if(_mask & (1ull << ii))
+				CPU_SET(ii, &set);
+		}
+		return ::pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+		return false;
+#endif
+	}
+
 	static void yield()
 	{
 #ifdef WALO_PLATFORM_WINDOWS
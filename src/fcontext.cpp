@@ -1,5 +1,6 @@
 #include <assert.h>
 #include <math.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "FContext.h"
@@ -97,15 +98,11 @@ static size_t getDefaultSize()
 }
 #endif
 
-/* Stack allocation and protection*/
-fcontext_stack_t create_fcontext_stack(size_t size)
+/* Stack size rounded down to whole pages, guard page included */
+static size_t getStackSize(size_t size)
 {
 	size_t pages;
 	size_t size_;
-	void* vp;
-	fcontext_stack_t s;
-	s.sptr = NULL;
-	s.ssize = 0;
 
 	if(size == 0)
 		size = getDefaultSize();
@@ -119,6 +116,19 @@ fcontext_stack_t create_fcontext_stack(size_t size)
 	size_ = pages * getPageSize();
 	assert(size_ != 0 && size != 0);
 	assert(size_ <= size);
+	return size_;
+}
+
+/* Stack allocation and protection*/
+fcontext_stack_t create_fcontext_stack(size_t size)
+{
+	size_t size_;
+	void* vp;
+	fcontext_stack_t s;
+	s.sptr = NULL;
+	s.ssize = 0;
+
+	size_ = getStackSize(size);
 
 #ifdef _WIN32
 	vp = VirtualAlloc(0, size_, MEM_COMMIT, PAGE_READWRITE);
@@ -165,4 +175,166 @@ void destroy_fcontext_stack(fcontext_stack_t* s)
 #endif
 
 	memset(s, 0x00, sizeof(fcontext_stack_t));
+}
+
+size_t get_fcontext_guard_size()
+{
+	return getPageSize();
+}
+
+size_t get_fcontext_arena_stack_size(size_t size)
+{
+	return getStackSize(size);
+}
+
+bool create_fcontext_arena(fcontext_arena_t* a, size_t size, size_t maxStacks, int flags)
+{
+	void* vp;
+
+	memset(a, 0x00, sizeof(fcontext_arena_t));
+
+	/* Protections can't be changed at page granularity inside huge pages */
+	if(flags & FCONTEXT_ARENA_HUGE_PAGES)
+		flags &= ~FCONTEXT_ARENA_GUARD_PAGES;
+
+	a->stacks = (fcontext_stack_t*)malloc(sizeof(fcontext_stack_t)*maxStacks);
+	if(!a->stacks)
+		return false;
+
+#ifdef _WIN32
+	vp = NULL;
+	if(flags & FCONTEXT_ARENA_HUGE_PAGES)
+	{
+		/* Needs SeLockMemoryPrivilege, fall back to regular pages without it */
+		size_t large = GetLargePageMinimum();
+		if(large)
+		{
+			size_t sizeLarge = (size + large - 1) & ~(large - 1);
+			vp = VirtualAlloc(0, sizeLarge, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+			if(vp)
+				size = sizeLarge;
+		}
+	}
+	if(!vp)
+		vp = VirtualAlloc(0, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+	if(!vp)
+	{
+		free(a->stacks);
+		a->stacks = NULL;
+		return false;
+	}
+#elif defined(_HAVE_POSIX)
+# if defined(MAP_ANON)
+	int mapFlags = MAP_PRIVATE | MAP_ANON;
+# else
+	int mapFlags = MAP_PRIVATE | MAP_ANONYMOUS;
+# endif
+	vp = MAP_FAILED;
+# if defined(MAP_HUGETLB)
+	if(flags & FCONTEXT_ARENA_HUGE_PAGES)
+	{
+		/* Needs reserved huge pages (vm.nr_hugepages), fall back to transparent huge pages without them */
+		size_t huge = 2 * 1024 * 1024;
+		size_t sizeHuge = (size + huge - 1) & ~(huge - 1);
+		vp = mmap(0, sizeHuge, PROT_READ | PROT_WRITE, mapFlags | MAP_HUGETLB, -1, 0);
+		if(vp != MAP_FAILED)
+			size = sizeHuge;
+	}
+# endif
+	if(vp == MAP_FAILED)
+	{
+		vp = mmap(0, size, PROT_READ | PROT_WRITE, mapFlags, -1, 0);
+		if(vp == MAP_FAILED)
+		{
+			free(a->stacks);
+			a->stacks = NULL;
+			return false;
+		}
+# if defined(MADV_HUGEPAGE)
+		if(flags & FCONTEXT_ARENA_HUGE_PAGES)
+			madvise(vp, size, MADV_HUGEPAGE);
+# endif
+	}
+#else
+	vp = malloc(size);
+	if(!vp)
+	{
+		free(a->stacks);
+		a->stacks = NULL;
+		return false;
+	}
+#endif
+
+	a->base = vp;
+	a->size = size;
+	a->used = 0;
+	a->flags = flags;
+	a->numStacks = 0;
+	a->maxStacks = maxStacks;
+	return true;
+}
+
+void destroy_fcontext_arena(fcontext_arena_t* a)
+{
+	if(a->base)
+	{
+#ifdef _WIN32
+		VirtualFree(a->base, 0, MEM_RELEASE);
+#elif defined(_HAVE_POSIX)
+		munmap(a->base, a->size);
+#else
+		free(a->base);
+#endif
+	}
+
+	if(a->stacks)
+		free(a->stacks);
+
+	memset(a, 0x00, sizeof(fcontext_arena_t));
+}
+
+fcontext_stack_t carve_fcontext_stack(fcontext_arena_t* a, size_t size)
+{
+	size_t size_;
+	char* vp;
+	fcontext_stack_t s;
+	s.sptr = NULL;
+	s.ssize = 0;
+
+	size_ = getStackSize(size);
+	if(a->used + size_ > a->size || a->numStacks == a->maxStacks)
+		return s;
+
+	vp = (char*)a->base + a->used;
+	a->used += size_;
+
+	if(a->flags & FCONTEXT_ARENA_GUARD_PAGES)
+	{
+#ifdef _WIN32
+		DWORD old_options;
+		VirtualProtect(vp, getPageSize(), PAGE_READWRITE | PAGE_GUARD, &old_options);
+#elif defined(_HAVE_POSIX)
+		mprotect(vp, getPageSize(), PROT_NONE);
+#endif
+	}
+
+	s.sptr = vp + size_;
+	s.ssize = size_;
+	a->stacks[a->numStacks++] = s;
+	return s;
+}
+
+void prefault_fcontext_arena(fcontext_arena_t* a, size_t part, size_t count)
+{
+	size_t pageSize = getPageSize();
+
+	for(size_t i = part; i < a->numStacks; i += count)
+	{
+		volatile char* top = (volatile char*)a->stacks[i].sptr;
+		volatile char* bottom = top - a->stacks[i].ssize + pageSize;
+
+		/* Write fault on every page, top down like the stack grows */
+		for(volatile char* p = top - pageSize; p >= bottom; p -= pageSize)
+			*p = 0;
+	}
 }
\ No newline at end of file
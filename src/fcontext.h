@@ -28,6 +28,9 @@ typedef void(*pfn_fcontext)(fcontext_transfer_t);
 
 /**
 * Switches to another context
+* Only the callee-saved general registers go along (and the stack), unlike stock Boost.Context the
+* FPU control state (MXCSR and x87 control word, FPCR on arm64) stays with the thread. Code that
+* changes rounding or denormal modes restores them before it switches. ontop_fcontext does the same
 * @param to Target context to switch to
 * @param vp Custom user pointer to pass to new context
 */
@@ -46,6 +49,55 @@ fcontext_transfer_t ontop_fcontext(fcontext_t const to, void * vp, fcontext_tran
 fcontext_stack_t create_fcontext_stack(size_t size = 0);
 void destroy_fcontext_stack(fcontext_stack_t* s);
 
+/**
+* Size of the protected region at the bottom of each stack made by create_fcontext_stack
+*/
+size_t get_fcontext_guard_size();
+
+#define FCONTEXT_ARENA_GUARD_PAGES 0x1  /* protect the bottom page of each carved stack */
+#define FCONTEXT_ARENA_HUGE_PAGES 0x2   /* MAP_HUGETLB, else transparent huge pages (no guard pages) */
+
+/**
+* Single mapping that many stacks are carved from
+* Stacks keep the create_fcontext_stack layout (guard region at the bottom), so one mmap replaces
+* one mmap per stack. Stacks are released all at once with the arena
+*/
+struct fcontext_arena_t
+{
+	void* base;
+	size_t size;
+	size_t used;
+	int flags;
+	fcontext_stack_t* stacks;   /* carved stacks, for prefaulting */
+	size_t numStacks;
+	size_t maxStacks;
+};
+
+/**
+* Bytes an arena needs for one stack of the given size
+*/
+size_t get_fcontext_arena_stack_size(size_t size);
+
+/**
+* Reserve an arena
+* @param size Total size, sum of get_fcontext_arena_stack_size for every stack
+* @param maxStacks Number of stacks that will be carved
+* @param flags FCONTEXT_ARENA_ flags
+*/
+bool create_fcontext_arena(fcontext_arena_t* a, size_t size, size_t maxStacks, int flags);
+void destroy_fcontext_arena(fcontext_arena_t* a);
+
+/**
+* Carve the next stack from the arena, sptr is NULL if the arena is full. Not thread-safe
+*/
+fcontext_stack_t carve_fcontext_stack(fcontext_arena_t* a, size_t size);
+
+/**
+* Touch every usable page of the carved stacks with (index % count) == part
+* so count threads can fault the whole arena in parallel
+*/
+void prefault_fcontext_arena(fcontext_arena_t* a, size_t part, size_t count);
+
 #ifdef __cplusplus
 }
 #endif
\ No newline at end of file